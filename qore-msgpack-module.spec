@@ -5,7 +5,7 @@
 %global user_module_dir %{mydatarootdir}/qore-modules/
 
 Name:           qore-msgpack-module
-Version:        1.0.1
+Version:        1.1.0
 Release:        1
 Summary:        Qorus Integration Engine - Qore msgpack module
 License:        MIT
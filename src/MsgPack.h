@@ -28,12 +28,17 @@
 #ifndef _QORE_MODULE_MSGPACK_MSGPACK_H
 #define _QORE_MODULE_MSGPACK_MSGPACK_H
 
+// std
+#include <atomic>
+#include <mutex>
+
 // qore
 #include "qore/Qore.h"
 
 // module sources
 #include "msgpack_enums.h"
 #include "msgpack_pack.h"
+#include "MsgPackBuffer.h"
 #include "msgpack_unpack.h"
 #include "MsgPackException.h"
 
@@ -47,6 +52,55 @@ class MsgPack : public AbstractPrivateData {
 private:
     msgpack::OperationMode mode;
 
+    //! Scratch buffer reused by pack() calls.
+    msgpack::MsgPackBuffer scratch;
+
+    //! Guards the scratch buffer; concurrent callers fall back to a private buffer.
+    std::mutex scratchLock;
+
+    //! Cache of hash keys used by unpack() calls (disabled by default).
+    msgpack::MsgPackKeyCache keyCache{0};
+
+    //! Guards the key cache; concurrent callers unpack without it.
+    std::mutex keyCacheLock;
+
+    //! Cache of pre-encoded hash keys used by pack calls (disabled by default).
+    msgpack::MsgPackKeyCache packKeyCache{0};
+
+    //! Guards the pre-encoded key cache; concurrent callers pack without it.
+    std::mutex packKeyCacheLock;
+
+    //! Whether unpacked data comes from a trusted producer and strings are not validated.
+    std::atomic<bool> trustedInput{false};
+
+    //! Maximum nesting depth of packed lists and hashes.
+    size_t packMaxDepth = SIZE_MAX;
+
+    //! Whether floats that convert to float32 without loss are packed as float32.
+    bool compactFloats = false;
+
+    //! Whether int and float lists are packed as typed arrays in Qore mode.
+    bool typedArrays = false;
+
+    //! Whether numbers are packed with the decimal number subtype in Qore mode when possible.
+    bool decimalNumbers = false;
+
+    //! Limits of unpacked data (disabled by default).
+    msgpack::intern::UnpackLimits unpackLimits;
+
+    //! Whether any limit of unpacked data is set.
+    bool hasUnpackLimits = false;
+
+    //! Guards the limits of unpacked data.
+    std::mutex unpackLimitsLock;
+
+    //! Copy the limits of unpacked data; returns false if no limit is set.
+    DLLLOCAL bool getLimits(msgpack::intern::UnpackLimits& limits) {
+        std::lock_guard<std::mutex> lock(unpackLimitsLock);
+        limits = unpackLimits;
+        return hasUnpackLimits;
+    }
+
 public:
     //! Constructor.
     DLLLOCAL MsgPack(msgpack::OperationMode m = msgpack::MSGPACK_SIMPLE_MODE) : mode(m) {}
@@ -57,10 +111,136 @@ public:
     //! Set operation mode used for packing and unpacking.
     DLLLOCAL void setOperationMode(msgpack::OperationMode m) { mode = m; }
 
+    //! Get the maximum nesting depth of packed lists and hashes (SIZE_MAX if not limited).
+    DLLLOCAL size_t getPackMaxDepth() const { return packMaxDepth; }
+
+    //! Set the maximum nesting depth of packed lists and hashes.
+    DLLLOCAL void setPackMaxDepth(size_t depth) { packMaxDepth = depth; }
+
+    //! Check whether floats are packed as float32 when they convert without loss.
+    DLLLOCAL bool getCompactFloats() const { return compactFloats; }
+
+    //! Set whether floats are packed as float32 when they convert without loss.
+    DLLLOCAL void setCompactFloats(bool compact) { compactFloats = compact; }
+
+    //! Check whether int and float lists are packed as typed arrays in Qore mode.
+    DLLLOCAL bool getTypedArrays() const { return typedArrays; }
+
+    //! Set whether int and float lists are packed as typed arrays in Qore mode.
+    DLLLOCAL void setTypedArrays(bool typed) { typedArrays = typed; }
+
+    //! Check whether numbers are packed with the decimal number subtype in Qore mode when possible.
+    DLLLOCAL bool getDecimalNumbers() const { return decimalNumbers; }
+
+    //! Set whether numbers are packed with the decimal number subtype in Qore mode when possible.
+    DLLLOCAL void setDecimalNumbers(bool decimal) { decimalNumbers = decimal; }
+
+    //! Check whether unpacked data is trusted to contain valid UTF-8 strings.
+    DLLLOCAL bool getTrustedInput() const { return trustedInput; }
+
+    //! Set whether unpacked data is trusted to contain valid UTF-8 strings.
+    DLLLOCAL void setTrustedInput(bool trusted) { trustedInput = trusted; }
+
+    //! Get the limits of unpacked data.
+    DLLLOCAL msgpack::intern::UnpackLimits getUnpackLimits() {
+        std::lock_guard<std::mutex> lock(unpackLimitsLock);
+        return unpackLimits;
+    }
+
+    //! Set the limits of unpacked data.
+    DLLLOCAL void setUnpackLimits(const msgpack::intern::UnpackLimits& limits) {
+        std::lock_guard<std::mutex> lock(unpackLimitsLock);
+        unpackLimits = limits;
+        hasUnpackLimits = limits.maxDepth != SIZE_MAX || limits.maxElements != SIZE_MAX
+            || limits.maxStrSize != SIZE_MAX || limits.maxBinSize != SIZE_MAX
+            || limits.maxExtSize != SIZE_MAX || limits.maxAllocSize != SIZE_MAX;
+    }
+
+    //! Check whether the scratch buffer is sized from a moving average of output sizes.
+    DLLLOCAL bool getAdaptiveBufferSize() {
+        std::lock_guard<std::mutex> lock(scratchLock);
+        return scratch.isAdaptive();
+    }
+
+    //! Enable or disable scratch buffer sizing based on a moving average of output sizes.
+    DLLLOCAL void setAdaptiveBufferSize(bool adaptive) {
+        std::lock_guard<std::mutex> lock(scratchLock);
+        scratch.setAdaptive(adaptive);
+    }
+
+    //! Get the current size of the scratch buffer.
+    DLLLOCAL size_t getBufferSize() {
+        std::lock_guard<std::mutex> lock(scratchLock);
+        return scratch.getCapacity();
+    }
+
+    //! Release the scratch buffer.
+    DLLLOCAL void releaseBuffer() {
+        std::lock_guard<std::mutex> lock(scratchLock);
+        scratch.reset();
+    }
+
+    //! Get the maximum number of cached hash keys (0 if the key cache is disabled).
+    DLLLOCAL size_t getKeyCacheSize() {
+        std::lock_guard<std::mutex> lock(keyCacheLock);
+        return keyCache.getMaxSize();
+    }
+
+    //! Set the maximum number of cached hash keys; 0 disables the key cache.
+    DLLLOCAL void setKeyCacheSize(size_t size) {
+        std::lock_guard<std::mutex> lock(keyCacheLock);
+        keyCache.setMaxSize(size);
+    }
+
+    //! Get the number of cached hash keys.
+    DLLLOCAL size_t getKeyCacheCount() {
+        std::lock_guard<std::mutex> lock(keyCacheLock);
+        return keyCache.size();
+    }
+
+    //! Remove all cached hash keys.
+    DLLLOCAL void clearKeyCache() {
+        std::lock_guard<std::mutex> lock(keyCacheLock);
+        keyCache.clear();
+    }
+
+    //! Get the maximum number of pre-encoded hash keys (0 if the pack key cache is disabled).
+    DLLLOCAL size_t getPackKeyCacheSize() {
+        std::lock_guard<std::mutex> lock(packKeyCacheLock);
+        return packKeyCache.getMaxSize();
+    }
+
+    //! Set the maximum number of pre-encoded hash keys; 0 disables the pack key cache.
+    DLLLOCAL void setPackKeyCacheSize(size_t size) {
+        std::lock_guard<std::mutex> lock(packKeyCacheLock);
+        packKeyCache.setMaxSize(size);
+    }
+
+    //! Get the number of pre-encoded hash keys.
+    DLLLOCAL size_t getPackKeyCacheCount() {
+        std::lock_guard<std::mutex> lock(packKeyCacheLock);
+        return packKeyCache.size();
+    }
+
+    //! Remove all pre-encoded hash keys.
+    DLLLOCAL void clearPackKeyCache() {
+        std::lock_guard<std::mutex> lock(packKeyCacheLock);
+        packKeyCache.clear();
+    }
+
     //! Pack passed value into MessagePack format binary.
     DLLLOCAL QoreValue pack(ExceptionSink* xsink, QoreValue value) {
         try {
-            QoreValue result(msgpack::intern::msgpack_pack(value, mode, xsink));
+            // use the pack key cache unless it is disabled or another thread is already packing with it
+            std::unique_lock<std::mutex> cacheLock(packKeyCacheLock, std::try_to_lock);
+            msgpack::intern::PackContext ctx(mode,
+                cacheLock.owns_lock() && packKeyCache.getMaxSize() ? &packKeyCache : nullptr, packMaxDepth, compactFloats, typedArrays, decimalNumbers);
+
+            // use the scratch buffer unless another thread is already packing with it
+            std::unique_lock<std::mutex> lock(scratchLock, std::try_to_lock);
+            QoreValue result(lock.owns_lock()
+                ? msgpack::intern::msgpack_pack(value, ctx, scratch, xsink)
+                : msgpack::intern::msgpack_pack(value, ctx, xsink));
             if (xsink && *xsink)
                 return QoreValue();
             return result;
@@ -71,12 +251,48 @@ public:
         return QoreValue();
     }
 
+    //! Append the packed value to the binary referenced by \a ref; returns the number of bytes appended.
+    DLLLOCAL int64 packInto(ExceptionSink* xsink, const ReferenceNode* ref, QoreValue value) {
+        try {
+            std::unique_lock<std::mutex> cacheLock(packKeyCacheLock, std::try_to_lock);
+            msgpack::intern::PackContext ctx(mode,
+                cacheLock.owns_lock() && packKeyCache.getMaxSize() ? &packKeyCache : nullptr, packMaxDepth, compactFloats, typedArrays, decimalNumbers);
+            size_t size = msgpack::intern::msgpack_pack_into(ref, value, ctx, xsink);
+            if (xsink && *xsink)
+                return 0;
+            return static_cast<int64>(size);
+        }
+        catch (msgpack::MsgPackException ex) {
+            xsink->raiseException("PACK-ERROR", ex.err);
+        }
+        return 0;
+    }
+
+    //! Pack the passed value into an output stream.
+    DLLLOCAL void packToStream(ExceptionSink* xsink, OutputStream* os, QoreValue value) {
+        try {
+            std::unique_lock<std::mutex> cacheLock(packKeyCacheLock, std::try_to_lock);
+            msgpack::intern::PackContext ctx(mode,
+                cacheLock.owns_lock() && packKeyCache.getMaxSize() ? &packKeyCache : nullptr, packMaxDepth, compactFloats, typedArrays, decimalNumbers);
+            msgpack::intern::msgpack_pack_to_stream(os, value, ctx, xsink);
+        }
+        catch (msgpack::MsgPackException ex) {
+            xsink->raiseException("PACK-ERROR", ex.err);
+        }
+    }
+
     //! Unpack passed MessagePack data.
     DLLLOCAL QoreValue unpack(ExceptionSink* xsink, QoreValue value) {
         try {
+            // use the key cache unless it is disabled or another thread is already unpacking with it
+            std::unique_lock<std::mutex> lock(keyCacheLock, std::try_to_lock);
+            msgpack::intern::UnpackLimits limits;
+            bool limited = getLimits(limits);
+            msgpack::intern::UnpackContext ctx(mode,
+                lock.owns_lock() && keyCache.getMaxSize() ? &keyCache : nullptr, trustedInput, limited ? &limits : nullptr);
             QoreValue result(msgpack::intern::msgpack_unpack(
                 value.get<BinaryNode>(),
-                mode,
+                ctx,
                 xsink
             ));
             if (xsink && *xsink)
@@ -88,6 +304,42 @@ public:
         }
         return QoreValue();
     }
+
+    //! Unpack passed MessagePack data, keeping only the map entries selected by the projection.
+    DLLLOCAL QoreValue unpackProjected(ExceptionSink* xsink, const BinaryNode* data, const QoreHashNode* projection) {
+        try {
+            std::unique_lock<std::mutex> lock(keyCacheLock, std::try_to_lock);
+            msgpack::intern::UnpackLimits limits;
+            bool limited = getLimits(limits);
+            msgpack::intern::UnpackContext ctx(mode,
+                lock.owns_lock() && keyCache.getMaxSize() ? &keyCache : nullptr, trustedInput, limited ? &limits : nullptr);
+            QoreValue result(msgpack::intern::msgpack_unpack_projected(data, projection, ctx, xsink));
+            if (xsink && *xsink)
+                return QoreValue();
+            return result;
+        }
+        catch (msgpack::MsgPackException ex) {
+            xsink->raiseException("UNPACK-ERROR", ex.err);
+        }
+        return QoreValue();
+    }
+
+    //! Unpack all MessagePack values available in an input stream.
+    DLLLOCAL QoreValue unpackFromStream(ExceptionSink* xsink, InputStream* is) {
+        try {
+            msgpack::intern::UnpackLimits limits;
+            bool limited = getLimits(limits);
+            msgpack::intern::UnpackContext ctx(mode, nullptr, trustedInput, limited ? &limits : nullptr);
+            QoreValue result(msgpack::intern::msgpack_unpack_from_stream(is, ctx, xsink));
+            if (xsink && *xsink)
+                return QoreValue();
+            return result;
+        }
+        catch (msgpack::MsgPackException ex) {
+            xsink->raiseException("UNPACK-ERROR", ex.err);
+        }
+        return QoreValue();
+    }
 };
 
 } // namespace msgpack
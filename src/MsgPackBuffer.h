@@ -0,0 +1,131 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+  MsgPackBuffer.h
+
+  Qore MessagePack module
+
+  Copyright (C) 2018 Qore Technologies, s.r.o.
+
+  Permission is hereby granted, free of charge, to any person obtaining a
+  copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the
+  Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _QORE_MODULE_MSGPACK_MSGPACKBUFFER_H
+#define _QORE_MODULE_MSGPACK_MSGPACKBUFFER_H
+
+// std
+#include <cstdlib>
+
+// qore
+#include "qore/Qore.h"
+
+// mpack library
+#include "mpack/mpack.h"
+
+namespace msgpack {
+
+//! Reusable scratch buffer for packing.
+/**
+    The buffer keeps its allocation between packing calls, so that repeated
+    packing of similarly sized values does not need to grow a new buffer each
+    time. By default the buffer remembers its high-water mark; with adaptive
+    sizing enabled it is instead shrunk back towards a moving average of recent
+    output sizes after an unusually large value has been packed.
+*/
+class MsgPackBuffer {
+public:
+    DLLLOCAL MsgPackBuffer() {}
+
+    DLLLOCAL ~MsgPackBuffer() {
+        free(buf);
+    }
+
+    //! Get the scratch buffer (null if not allocated yet).
+    DLLLOCAL char* getBuffer() const { return buf; }
+
+    //! Get the current size of the scratch buffer.
+    DLLLOCAL size_t getCapacity() const { return capacity; }
+
+    //! Get the moving average of recent output sizes.
+    DLLLOCAL size_t getAverage() const { return average; }
+
+    //! Check whether adaptive sizing is enabled.
+    DLLLOCAL bool isAdaptive() const { return adaptive; }
+
+    //! Enable or disable adaptive sizing.
+    DLLLOCAL void setAdaptive(bool a) { adaptive = a; }
+
+    //! Make sure the scratch buffer is allocated; returns false on allocation failure.
+    DLLLOCAL bool prepare() {
+        return buf || resize(initialSize());
+    }
+
+    //! Grow the scratch buffer (at least doubling it) to hold at least \a needed bytes, keeping its contents.
+    DLLLOCAL bool grow(size_t needed) {
+        size_t newSize = capacity ? capacity * 2 : MPACK_BUFFER_SIZE;
+        while (newSize < needed)
+            newSize *= 2;
+        return resize(newSize);
+    }
+
+    //! Update sizing statistics after a value of \a size bytes has been packed.
+    DLLLOCAL void update(size_t size) {
+        // exponential moving average with a weight of 1/8 for the latest value
+        average = average ? (average * 7 + size) / 8 : size;
+
+        if (adaptive) {
+            size_t target = average * 2;
+            if (target < MPACK_BUFFER_SIZE)
+                target = MPACK_BUFFER_SIZE;
+            if (capacity > target * 2)
+                resize(target);
+        }
+    }
+
+    //! Release the scratch buffer and reset statistics.
+    DLLLOCAL void reset() {
+        free(buf);
+        buf = nullptr;
+        capacity = 0;
+        average = 0;
+    }
+
+private:
+    char* buf = nullptr;
+    size_t capacity = 0;
+    size_t average = 0;
+    bool adaptive = false;
+
+    DLLLOCAL size_t initialSize() const {
+        size_t size = average + average / 4;
+        return size < MPACK_BUFFER_SIZE ? MPACK_BUFFER_SIZE : size;
+    }
+
+    DLLLOCAL bool resize(size_t size) {
+        char* nbuf = static_cast<char*>(realloc(buf, size));
+        if (!nbuf)
+            return false;
+        buf = nbuf;
+        capacity = size;
+        return true;
+    }
+};
+
+} // namespace msgpack
+
+#endif // _QORE_MODULE_MSGPACK_MSGPACKBUFFER_H
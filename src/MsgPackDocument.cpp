@@ -0,0 +1,174 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+  MsgPackDocument.cpp
+
+  Qore MessagePack module
+
+  Copyright (C) 2018 Qore Technologies, s.r.o.
+
+  Permission is hereby granted, free of charge, to any person obtaining a
+  copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the
+  Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+#include "MsgPackDocument.h"
+
+// module sources
+#include "msgpack_unpack.h"
+#include "MsgPackException.h"
+
+namespace msgpack {
+
+const MsgPackDocument::ContainerIndex* MsgPackDocument::getIndex(size_t offset) {
+    auto i = index.find(offset);
+    if (i != index.end())
+        return &i->second;
+
+    const char* buf = getBuffer();
+    size_t size = data->size();
+    uint8_t type = static_cast<uint8_t>(buf[offset]);
+    bool map = intern::msgpack_is_map_type(type);
+    if (!map && !intern::msgpack_is_array_type(type))
+        return nullptr;
+
+    intern::ScanHeader hdr;
+    // every element takes at least one byte
+    if (!intern::msgpack_scan_header(buf + offset, size - offset, hdr) || hdr.children > size - offset - hdr.size)
+        throw getMsgPackException(mpack_error_invalid);
+
+    // the index is only cached once the whole container has been scanned without errors
+    ContainerIndex ci;
+    ci.map = map;
+    ci.offsets.reserve(hdr.children + 1);
+    size_t pos = offset + hdr.size;
+    for (uint64_t n = 0; n < hdr.children; ++n) {
+        ci.offsets.push_back(pos);
+        pos = intern::msgpack_scan_value(buf, size, pos);
+    }
+    ci.offsets.push_back(pos);
+    return &index.emplace(offset, std::move(ci)).first->second;
+}
+
+size_t MsgPackDocument::resolve(const QoreString* path, ExceptionSink* xsink) {
+    if (!data->size())
+        return npos;
+
+    TempEncodingHelper p(path, QCS_UTF8, xsink);
+    if (!p)
+        return npos;
+
+    const char* buf = getBuffer();
+    const char* str = p->c_str();
+    size_t len = p->size();
+    size_t offset = 0;
+    size_t pos = 0;
+
+    while (pos < len) {
+        intern::PathSegment seg;
+        if (intern::msgpack_parse_path_segment(str, len, pos, seg, xsink))
+            return npos;
+
+        const ContainerIndex* ci = getIndex(offset);
+        if (seg.isIndex) {
+            if (!ci || ci->map || seg.index >= ci->size())
+                return npos;
+            offset = ci->offsets[seg.index];
+            continue;
+        }
+        if (!ci || !ci->map)
+            return npos;
+
+        // the last occurrence of a duplicate key wins, like when unpacking into a hash
+        size_t found = npos;
+        for (size_t i = 0, e = ci->size(); i < e; ++i) {
+            if (intern::msgpack_key_equals(buf, data->size(), ci->offsets[i * 2], seg.key, seg.len, mode, xsink))
+                found = ci->offsets[i * 2 + 1];
+            if (*xsink)
+                return npos;
+        }
+        if (found == npos)
+            return npos;
+        offset = found;
+    }
+
+    return offset;
+}
+
+QoreValue MsgPackDocument::materialize(size_t offset, ExceptionSink* xsink) {
+    return intern::msgpack_unpack_at(getBuffer(), data->size(), offset, mode, xsink);
+}
+
+QoreValue MsgPackDocument::get(ExceptionSink* xsink, const QoreString* path) {
+    std::lock_guard<std::mutex> guard(lock);
+    try {
+        size_t offset = resolve(path, xsink);
+        if (offset == npos || *xsink)
+            return QoreValue();
+        ValueHolder value(materialize(offset, xsink), xsink);
+        if (*xsink)
+            return QoreValue();
+        return value.release();
+    }
+    catch (MsgPackException ex) {
+        xsink->raiseException("UNPACK-ERROR", ex.err);
+    }
+    return QoreValue();
+}
+
+QoreListNode* MsgPackDocument::keys(ExceptionSink* xsink, const QoreString* path) {
+    std::lock_guard<std::mutex> guard(lock);
+    try {
+        size_t offset = resolve(path, xsink);
+        if (offset == npos || *xsink)
+            return nullptr;
+        const ContainerIndex* ci = getIndex(offset);
+        if (!ci || !ci->map)
+            return nullptr;
+
+        ReferenceHolder<QoreListNode> list(new QoreListNode(stringTypeInfo), xsink);
+        for (size_t i = 0, e = ci->size(); i < e; ++i) {
+            ValueHolder key(materialize(ci->offsets[i * 2], xsink), xsink);
+            if (*xsink)
+                return nullptr;
+            if (key->getType() != NT_STRING)
+                throw getMsgPackException(mpack_error_data);
+            list->push(key.release(), xsink);
+        }
+        return list.release();
+    }
+    catch (MsgPackException ex) {
+        xsink->raiseException("UNPACK-ERROR", ex.err);
+    }
+    return nullptr;
+}
+
+size_t MsgPackDocument::size(ExceptionSink* xsink, const QoreString* path) {
+    std::lock_guard<std::mutex> guard(lock);
+    try {
+        size_t offset = resolve(path, xsink);
+        if (offset == npos || *xsink)
+            return 0;
+        const ContainerIndex* ci = getIndex(offset);
+        return ci ? ci->size() : 0;
+    }
+    catch (MsgPackException ex) {
+        xsink->raiseException("UNPACK-ERROR", ex.err);
+    }
+    return 0;
+}
+
+} // namespace msgpack
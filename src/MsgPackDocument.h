@@ -0,0 +1,104 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    MsgPackDocument.h
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _QORE_MODULE_MSGPACK_MSGPACKDOCUMENT_H
+#define _QORE_MODULE_MSGPACK_MSGPACKDOCUMENT_H
+
+// std
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// qore
+#include "qore/Qore.h"
+
+// module sources
+#include "msgpack_enums.h"
+
+namespace msgpack {
+
+//! Lazily decoded MessagePack document.
+/**
+    Wraps packed data and decodes only the values that are actually accessed.
+    Containers on accessed paths are indexed on first use: the index holds the
+    offsets of their elements, so later accesses jump directly to a value
+    without scanning its siblings again.
+*/
+class MsgPackDocument : public AbstractPrivateData {
+public:
+    //! Offset returned for paths that do not exist.
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+private:
+    //! Offset index of a single container.
+    struct ContainerIndex {
+        bool map;
+        //! Start offsets of all elements (keys and values interleaved for maps) followed by the end offset.
+        std::vector<size_t> offsets;
+
+        DLLLOCAL size_t size() const { return map ? (offsets.size() - 1) / 2 : offsets.size() - 1; }
+    };
+
+    msgpack::OperationMode mode;
+    SimpleRefHolder<BinaryNode> data;
+
+    //! Container indexes by container offset.
+    std::unordered_map<size_t, ContainerIndex> index;
+
+    std::mutex lock;
+
+    DLLLOCAL const char* getBuffer() const { return static_cast<const char*>(data->getPtr()); }
+
+    //! Get the index of the container at \a offset; returns null if the value is not a container.
+    DLLLOCAL const ContainerIndex* getIndex(size_t offset);
+
+    //! Resolve \a path to the offset of the value it refers to (npos if not found).
+    DLLLOCAL size_t resolve(const QoreString* path, ExceptionSink* xsink);
+
+    //! Decode the value at \a offset.
+    DLLLOCAL QoreValue materialize(size_t offset, ExceptionSink* xsink);
+
+public:
+    //! Constructor; takes over the passed reference.
+    DLLLOCAL MsgPackDocument(BinaryNode* bin, msgpack::OperationMode m) : mode(m), data(bin) {}
+
+    //! Get operation mode used for unpacking.
+    DLLLOCAL msgpack::OperationMode getOperationMode() const { return mode; }
+
+    //! Decode the value at \a path.
+    DLLLOCAL QoreValue get(ExceptionSink* xsink, const QoreString* path);
+
+    //! Get the keys of the map at \a path.
+    DLLLOCAL QoreListNode* keys(ExceptionSink* xsink, const QoreString* path);
+
+    //! Get the number of elements of the container at \a path.
+    DLLLOCAL size_t size(ExceptionSink* xsink, const QoreString* path);
+};
+
+} // namespace msgpack
+
+#endif // _QORE_MODULE_MSGPACK_MSGPACKDOCUMENT_H
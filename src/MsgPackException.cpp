@@ -37,6 +37,7 @@ const char* MpackErrorTooBig        = "A read or write was bigger than the maxim
 const char* MpackErrorMemory        = "An allocation failure occurred.";
 const char* MpackErrorBug           = "The MPack API was used incorrectly. (This will always assert in debug mode.)";
 const char* MpackErrorData          = "The contained data is not valid.";
+const char* MpackErrorEOF           = "The reader failed to read because the end of the input was reached.";
 const char* MpackErrorUnknownIntern = "Unknown error occured.";
 
 MsgPackException getMsgPackException(mpack_error_t error) {
@@ -55,6 +56,8 @@ MsgPackException getMsgPackException(mpack_error_t error) {
             return MsgPackException(MpackErrorBug);
         case mpack_error_data:
             return MsgPackException(MpackErrorData);
+        case mpack_error_eof:
+            return MsgPackException(MpackErrorEOF);
         default:
             return MsgPackException(MpackErrorUnknownIntern);
     }
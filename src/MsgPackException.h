@@ -47,6 +47,7 @@ DLLLOCAL extern const char* MpackErrorTooBig;
 DLLLOCAL extern const char* MpackErrorMemory;
 DLLLOCAL extern const char* MpackErrorBug;
 DLLLOCAL extern const char* MpackErrorData;
+DLLLOCAL extern const char* MpackErrorEOF;
 DLLLOCAL extern const char* MpackErrorUnknownIntern;
 
 //! MessagePack module exception class.
@@ -0,0 +1,111 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+  MsgPackIterator.cpp
+
+  Qore MessagePack module
+
+  Copyright (C) 2018 Qore Technologies, s.r.o.
+
+  Permission is hereby granted, free of charge, to any person obtaining a
+  copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the
+  Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+#include "MsgPackIterator.h"
+
+// module sources
+#include "MsgPackException.h"
+
+namespace msgpack {
+
+MsgPackIterator::MsgPackIterator(BinaryNode* bin, msgpack::OperationMode m) : mode(m), data(bin) {
+    // empty binaries have no buffer; do not pass nullptr to mpack_reader_init_data() or it will assert
+    static const char empty[1] = {};
+    const char* buffer = static_cast<const char*>(bin->getPtr());
+    size_t size = bin->size();
+    if (!buffer || !size) {
+        buffer = empty;
+        size = 0;
+    }
+    mpack_reader_init_data(&reader, buffer, size);
+}
+
+MsgPackIterator::MsgPackIterator(InputStream* s, msgpack::OperationMode m) : mode(m), is(s) {
+    ctx.is = s;
+    intern::msgpack_stream_reader_init(&reader, buffer, sizeof(buffer), &ctx);
+}
+
+void MsgPackIterator::deref(ExceptionSink* xsink) {
+    if (ROdereference()) {
+        current.discard(xsink);
+        if (is)
+            is->deref(xsink);
+        delete this;
+    }
+}
+
+bool MsgPackIterator::hasMore(ExceptionSink* xsink) {
+    if (mpack_reader_remaining(&reader, nullptr))
+        return true;
+    return is && is->peek(xsink) >= 0;
+}
+
+bool MsgPackIterator::next(ExceptionSink* xsink) {
+    std::lock_guard<std::mutex> guard(lock);
+    current.discard(xsink);
+    current = QoreValue();
+    positioned = false;
+
+    if (done)
+        return false;
+
+    ctx.xsink = xsink;
+    try {
+        if (hasMore(xsink) && !*xsink) {
+            ValueHolder node(intern::msgpack_unpack_value(&reader, mode, xsink), xsink);
+            mpack_error_t error = mpack_reader_error(&reader);
+            if (error != mpack_ok) {
+                // stream errors have already been raised by the stream
+                if (error != mpack_error_io || !*xsink)
+                    throw getMsgPackException(error);
+            }
+            else if (!*xsink) {
+                current = node.release();
+                positioned = true;
+            }
+        }
+    }
+    catch (MsgPackException ex) {
+        xsink->raiseException("UNPACK-ERROR", ex.err);
+    }
+    ctx.xsink = nullptr;
+
+    if (!positioned)
+        done = true;
+    return positioned;
+}
+
+QoreValue MsgPackIterator::getValue(ExceptionSink* xsink) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!positioned) {
+        xsink->raiseException("INVALID-ITERATOR", "the MsgPackIterator is not pointing at a valid element; make sure MsgPackIterator::next() returns True before calling this method");
+        return QoreValue();
+    }
+    return current.refSelf();
+}
+
+} // namespace msgpack
@@ -0,0 +1,111 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    MsgPackIterator.h
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _QORE_MODULE_MSGPACK_MSGPACKITERATOR_H
+#define _QORE_MODULE_MSGPACK_MSGPACKITERATOR_H
+
+// std
+#include <mutex>
+
+// qore
+#include "qore/Qore.h"
+#include "qore/InputStream.h"
+
+// module sources
+#include "msgpack_enums.h"
+#include "msgpack_unpack.h"
+
+// mpack library
+#include "mpack/mpack.h"
+
+namespace msgpack {
+
+//! Iterator over concatenated top-level MessagePack values.
+/**
+    Values are decoded one at a time from a binary or an input stream, so only
+    the current value is held in memory.
+*/
+class MsgPackIterator : public AbstractPrivateData {
+private:
+    msgpack::OperationMode mode;
+
+    //! Source binary (if iterating a binary).
+    SimpleRefHolder<BinaryNode> data;
+
+    //! Source stream (if iterating a stream).
+    InputStream* is = nullptr;
+
+    //! Context and buffer of the stream reader.
+    intern::StreamReaderContext ctx = {nullptr, nullptr};
+    char buffer[MPACK_BUFFER_SIZE];
+
+    mpack_reader_t reader;
+
+    //! Current value.
+    QoreValue current;
+
+    //! Whether the iterator points at a value.
+    bool positioned = false;
+
+    //! Whether the end of the data has been reached or an error occurred.
+    bool done = false;
+
+    std::mutex lock;
+
+    //! Check whether there is more data to decode.
+    DLLLOCAL bool hasMore(ExceptionSink* xsink);
+
+protected:
+    DLLLOCAL virtual ~MsgPackIterator() {
+        mpack_reader_destroy(&reader);
+    }
+
+public:
+    //! Create an iterator over the values in a binary.
+    DLLLOCAL MsgPackIterator(BinaryNode* bin, msgpack::OperationMode m);
+
+    //! Create an iterator over the values in an input stream; takes over the passed reference.
+    DLLLOCAL MsgPackIterator(InputStream* s, msgpack::OperationMode m);
+
+    DLLLOCAL virtual void deref(ExceptionSink* xsink);
+
+    //! Decode the next value; returns false at the end of the data or on error.
+    DLLLOCAL bool next(ExceptionSink* xsink);
+
+    //! Check whether the iterator points at a value.
+    DLLLOCAL bool valid() {
+        std::lock_guard<std::mutex> guard(lock);
+        return positioned;
+    }
+
+    //! Get the current value (referenced).
+    DLLLOCAL QoreValue getValue(ExceptionSink* xsink);
+};
+
+} // namespace msgpack
+
+#endif // _QORE_MODULE_MSGPACK_MSGPACKITERATOR_H
@@ -0,0 +1,160 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    MsgPackKeyCache.h
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _QORE_MODULE_MSGPACK_MSGPACKKEYCACHE_H
+#define _QORE_MODULE_MSGPACK_MSGPACKKEYCACHE_H
+
+// std
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// qore
+#include "qore/Qore.h"
+
+namespace msgpack {
+
+//! Cache of hash keys seen while unpacking or packing.
+/**
+    Keys are looked up by their raw bytes, so a repeated key is found without
+    creating a string node or validating its UTF-8 encoding again. When packing,
+    each key is stored together with its encoded str header, so that it can be
+    written with a single copy.
+    The cache is an open-addressing hash table; once it holds the maximum
+    number of keys, new keys are no longer added.
+*/
+class MsgPackKeyCache {
+public:
+    //! Keys longer than this are never cached.
+    static constexpr size_t MaxKeySize = 128;
+
+    //! Maximum size of the prefix stored in front of a key.
+    static constexpr size_t MaxPrefixSize = 8;
+
+    //! Largest allowed maximum number of cached keys.
+    static constexpr size_t MaxSize = 1 << 24;
+
+    DLLLOCAL MsgPackKeyCache(size_t max = 1024) {
+        setMaxSize(max);
+    }
+
+    //! Find a cached key; returns null if the key is not cached.
+    /** The returned string includes the prefix the key was inserted with.
+    */
+    DLLLOCAL const std::string* find(const char* key, size_t len) const {
+        if (!count)
+            return nullptr;
+        uint32_t h = hash(key, len);
+        for (size_t i = h & mask; ; i = (i + 1) & mask) {
+            const Slot& slot = slots[i];
+            if (!slot.used)
+                return nullptr;
+            if (slot.hash == h && slot.key.size() == slot.offset + len
+                && !memcmp(slot.key.data() + slot.offset, key, len))
+                return &slot.key;
+        }
+    }
+
+    //! Add a key (which must be valid UTF-8 and not cached yet); returns null if it cannot be cached.
+    /** The optional prefix (at most MaxPrefixSize bytes) is stored in front of the key.
+    */
+    DLLLOCAL const std::string* insert(const char* key, size_t len, const char* prefix = nullptr, size_t prefixLen = 0) {
+        assert(prefixLen <= MaxPrefixSize);
+        if (count >= maxSize || len > MaxKeySize)
+            return nullptr;
+        if (slots.empty())
+            slots.resize(mask + 1);
+        uint32_t h = hash(key, len);
+        size_t i = h & mask;
+        while (slots[i].used)
+            i = (i + 1) & mask;
+        Slot& slot = slots[i];
+        slot.used = true;
+        slot.hash = h;
+        slot.offset = static_cast<uint8_t>(prefixLen);
+        slot.key.reserve(prefixLen + len);
+        slot.key.assign(prefix ? prefix : "", prefixLen);
+        slot.key.append(key, len);
+        ++count;
+        return &slot.key;
+    }
+
+    //! Get the number of cached keys.
+    DLLLOCAL size_t size() const { return count; }
+
+    //! Get the maximum number of cached keys.
+    DLLLOCAL size_t getMaxSize() const { return maxSize; }
+
+    //! Set the maximum number of cached keys (at most MaxSize); clears the cache.
+    DLLLOCAL void setMaxSize(size_t max) {
+        assert(max <= MaxSize);
+        if (max > MaxSize)
+            max = MaxSize;
+        maxSize = max;
+        // keep the load factor at 50% at most
+        size_t capacity = 16;
+        while (capacity < max * 2)
+            capacity *= 2;
+        mask = capacity - 1;
+        clear();
+    }
+
+    //! Remove all keys.
+    DLLLOCAL void clear() {
+        std::vector<Slot>().swap(slots);
+        count = 0;
+    }
+
+private:
+    struct Slot {
+        bool used = false;
+        uint8_t offset = 0;
+        uint32_t hash = 0;
+        //! prefix followed by the key bytes
+        std::string key;
+    };
+
+    std::vector<Slot> slots;
+    size_t mask = 0;
+    size_t count = 0;
+    size_t maxSize = 0;
+
+    //! FNV-1a hash of the key bytes.
+    DLLLOCAL static uint32_t hash(const char* key, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i) {
+            h ^= static_cast<uint8_t>(key[i]);
+            h *= 16777619u;
+        }
+        return h;
+    }
+};
+
+} // namespace msgpack
+
+#endif // _QORE_MODULE_MSGPACK_MSGPACKKEYCACHE_H
@@ -0,0 +1,470 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+  MsgPackSchema.cpp
+
+  Qore MessagePack module
+
+  Copyright (C) 2018 Qore Technologies, s.r.o.
+
+  Permission is hereby granted, free of charge, to any person obtaining a
+  copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the
+  Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+#include "MsgPackSchema.h"
+
+// std
+#include <cstring>
+
+// module sources
+#include "msgpack_unpack.h"
+#include "MsgPackException.h"
+
+namespace msgpack {
+
+namespace {
+
+// Returns the node type of values of the passed type, NT_NOTHING if values can have any type.
+qore_type_t schema_field_type(const QoreTypeInfo* typeInfo) {
+    if (typeInfo == bigIntTypeInfo || typeInfo == bigIntOrNothingTypeInfo || typeInfo == softBigIntTypeInfo
+        || typeInfo == softBigIntOrNothingTypeInfo)
+        return NT_INT;
+    if (typeInfo == floatTypeInfo || typeInfo == floatOrNothingTypeInfo || typeInfo == softFloatTypeInfo
+        || typeInfo == softFloatOrNothingTypeInfo)
+        return NT_FLOAT;
+    if (typeInfo == stringTypeInfo || typeInfo == stringOrNothingTypeInfo || typeInfo == softStringTypeInfo
+        || typeInfo == softStringOrNothingTypeInfo)
+        return NT_STRING;
+    if (typeInfo == boolTypeInfo || typeInfo == boolOrNothingTypeInfo || typeInfo == softBoolTypeInfo
+        || typeInfo == softBoolOrNothingTypeInfo)
+        return NT_BOOLEAN;
+    if (typeInfo == binaryTypeInfo || typeInfo == binaryOrNothingTypeInfo)
+        return NT_BINARY;
+    if (typeInfo == dateTypeInfo || typeInfo == dateOrNothingTypeInfo || typeInfo == softDateTypeInfo
+        || typeInfo == softDateOrNothingTypeInfo)
+        return NT_DATE;
+    if (typeInfo == numberTypeInfo || typeInfo == numberOrNothingTypeInfo || typeInfo == softNumberTypeInfo
+        || typeInfo == softNumberOrNothingTypeInfo)
+        return NT_NUMBER;
+    return NT_NOTHING;
+}
+
+// Returns true if the passed type accepts NOTHING.
+bool schema_field_or_nothing(const QoreTypeInfo* typeInfo) {
+    return typeInfo == bigIntOrNothingTypeInfo || typeInfo == floatOrNothingTypeInfo
+        || typeInfo == stringOrNothingTypeInfo || typeInfo == boolOrNothingTypeInfo
+        || typeInfo == binaryOrNothingTypeInfo || typeInfo == dateOrNothingTypeInfo
+        || typeInfo == numberOrNothingTypeInfo || typeInfo == softBigIntOrNothingTypeInfo
+        || typeInfo == softFloatOrNothingTypeInfo || typeInfo == softStringOrNothingTypeInfo
+        || typeInfo == softBoolOrNothingTypeInfo || typeInfo == softDateOrNothingTypeInfo
+        || typeInfo == softNumberOrNothingTypeInfo;
+}
+
+// Returns true if values of type \a valueType can be assigned to \a typeInfo without a runtime conversion.
+bool schema_type_accepts(const QoreTypeInfo* typeInfo, const QoreTypeInfo* valueType) {
+    bool mayNotMatch = false;
+    return qore_type_is_assignable_from(typeInfo, valueType, mayNotMatch) && !mayNotMatch;
+}
+
+// Returns the type of the passed unpacked value.
+const QoreTypeInfo* schema_value_type(QoreValue value) {
+    switch (value.getType()) {
+        case NT_NOTHING: return nothingTypeInfo;
+        case NT_NULL: return nullTypeInfo;
+        case NT_INT: return bigIntTypeInfo;
+        case NT_FLOAT: return floatTypeInfo;
+        case NT_STRING: return stringTypeInfo;
+        case NT_BOOLEAN: return boolTypeInfo;
+        case NT_BINARY: return binaryTypeInfo;
+        case NT_DATE: return dateTypeInfo;
+        case NT_NUMBER: return numberTypeInfo;
+        case NT_LIST: return value.get<const QoreListNode>()->getTypeInfo();
+        case NT_HASH: return value.get<const QoreHashNode>()->getTypeInfo();
+        case NT_OBJECT: return objectTypeInfo;
+        default: return autoTypeInfo;
+    }
+}
+
+// Scalar element types of list and hash members that untyped data is converted to.
+struct SchemaElementType {
+    const QoreTypeInfo* const* typeInfo;
+    qore_type_t type;
+};
+
+const SchemaElementType schema_element_types[] = {
+    {&bigIntTypeInfo, NT_INT},
+    {&floatTypeInfo, NT_FLOAT},
+    {&stringTypeInfo, NT_STRING},
+    {&boolTypeInfo, NT_BOOLEAN},
+    {&binaryTypeInfo, NT_BINARY},
+    {&dateTypeInfo, NT_DATE},
+    {&numberTypeInfo, NT_NUMBER},
+};
+
+// Sets the container and element type of list and hash members with a scalar element type (e.g. list<int>).
+void schema_field_element_type(MsgPackSchema::Field& field) {
+    qore_type_t base = static_cast<qore_type_t>(qore_type_get_base_type(field.typeInfo));
+    if (base != NT_LIST && base != NT_HASH)
+        return;
+
+    for (const SchemaElementType& e : schema_element_types) {
+        // complex types are created once and owned by the library, so the type outlives the container
+        const QoreTypeInfo* containerType;
+        if (base == NT_LIST) {
+            ReferenceHolder<QoreListNode> l(new QoreListNode(*e.typeInfo), nullptr);
+            containerType = l->getTypeInfo();
+        }
+        else {
+            ReferenceHolder<QoreHashNode> h(new QoreHashNode(*e.typeInfo), nullptr);
+            containerType = h->getTypeInfo();
+        }
+        if (schema_type_accepts(field.typeInfo, containerType)) {
+            field.containerType = base;
+            field.elementType = e.type;
+            field.elementTypeInfo = *e.typeInfo;
+            return;
+        }
+    }
+}
+
+// Returns the passed untyped list or hash as the container type of the field, nullptr if an element has another type.
+AbstractQoreNode* schema_convert_container(const MsgPackSchema::Field& field, QoreValue value, ExceptionSink* xsink) {
+    if (value.getType() == NT_LIST && field.containerType == NT_LIST) {
+        const QoreListNode* l = value.get<const QoreListNode>();
+        ReferenceHolder<QoreListNode> rv(new QoreListNode(field.elementTypeInfo), xsink);
+        for (size_t i = 0; i < l->size(); ++i) {
+            QoreValue e = l->retrieveEntry(i);
+            if (e.getType() != field.elementType)
+                return nullptr;
+            rv->push(e.refSelf(), xsink);
+        }
+        return rv.release();
+    }
+    if (value.getType() == NT_HASH && field.containerType == NT_HASH) {
+        ReferenceHolder<QoreHashNode> rv(new QoreHashNode(field.elementTypeInfo), xsink);
+        ConstHashIterator it(value.get<const QoreHashNode>());
+        while (it.next()) {
+            QoreValue e = it.get();
+            if (e.getType() != field.elementType)
+                return nullptr;
+            rv->setKeyValue(it.getKeyStr(), e.refSelf(), xsink);
+        }
+        return rv.release();
+    }
+    return nullptr;
+}
+
+} // namespace
+
+MsgPackSchema::MsgPackSchema(const TypedHashDecl* hd, msgpack::OperationMode m) : hashdecl(hd), mode(m) {
+    TypedHashDeclMemberIterator i(hashdecl);
+    while (i.next()) {
+        Field field;
+        field.name = i.getName();
+        field.typeInfo = i.getMember()->getTypeInfo();
+        field.type = schema_field_type(field.typeInfo);
+        field.orNothing = schema_field_or_nothing(field.typeInfo);
+        if (field.type == NT_NOTHING && field.typeInfo != autoTypeInfo)
+            schema_field_element_type(field);
+
+        // pre-encode the key; hash keys are stored in the default encoding
+        if (QCS_DEFAULT == QCS_UTF8 && msgpack::intern::msgpack_utf8_check(field.name.data(), field.name.size())) {
+            char header[MPACK_TAG_SIZE_STR32];
+            size_t headerSize = msgpack::intern::msgpack_encode_str_header(header, static_cast<uint32_t>(field.name.size()));
+            field.key.reserve(headerSize + field.name.size());
+            field.key.assign(header, headerSize);
+            field.key.append(field.name);
+        }
+        fields.push_back(std::move(field));
+    }
+}
+
+MsgPackSchema* MsgPackSchema::compile(ExceptionSink* xsink, const QoreHashNode* example, msgpack::OperationMode m) {
+    const TypedHashDecl* hd = example->getHashDecl();
+    if (!hd) {
+        xsink->raiseException("SCHEMA-ERROR", "cannot compile a schema from an untyped hash; a hash created from a hashdecl is required");
+        return nullptr;
+    }
+    return new MsgPackSchema(hd, m);
+}
+
+void MsgPackSchema::packHash(mpack_writer_t* writer, const QoreHashNode* value, msgpack::intern::PackContext& ctx, ExceptionSink* xsink) const {
+    using namespace msgpack::intern;
+
+    mpack_start_map(writer, static_cast<uint32_t>(value->size()));
+
+    // members of hashes created from the hashdecl always have the declared type (or NOTHING if the type
+    // accepts it), so only values of other hashes and of optional members need their type checked
+    bool typed = value->getHashDecl() == hashdecl;
+
+    size_t next = 0;
+    ConstHashIterator it(value);
+    while (it.next()) {
+        const std::string& name = it.getKeyStr();
+        QoreValue v = it.get();
+
+        // entries not following the declaration order are packed the generic way
+        if (next >= fields.size() || fields[next].name != name) {
+            msgpack_pack_qore_hash_key(writer, name, ctx, xsink);
+            msgpack_pack_qore_value(writer, v, ctx, xsink);
+            continue;
+        }
+
+        const Field& field = fields[next++];
+        if (field.key.empty())
+            msgpack_pack_qore_hash_key(writer, name, ctx, xsink);
+        else
+            mpack_write_object_bytes(writer, field.key.data(), field.key.size());
+
+        // values not having the declared type (e.g. NOTHING for optional members) are packed the generic way
+        if ((!typed || field.orNothing) && v.getType() != field.type) {
+            msgpack_pack_qore_value(writer, v, ctx, xsink);
+            continue;
+        }
+
+        // members without a known type are packed the generic way by the default case
+        switch (field.type) {
+            case NT_INT:
+                msgpack_pack_qore_int(writer, v); break;
+            case NT_FLOAT:
+                msgpack_pack_qore_float(writer, v, ctx.compactFloats); break;
+            case NT_STRING:
+                msgpack_pack_qore_string(writer, v.get<const QoreStringNode>(), ctx.mode, xsink); break;
+            case NT_BOOLEAN:
+                msgpack_pack_qore_bool(writer, v); break;
+            case NT_BINARY:
+                msgpack_pack_qore_binary(writer, v.get<const BinaryNode>()); break;
+            case NT_DATE:
+                msgpack_pack_qore_date(writer, v.get<const DateTimeNode>(), ctx.mode); break;
+            case NT_NUMBER:
+                msgpack_pack_qore_number(writer, v.get<const QoreNumberNode>(), ctx.mode); break;
+            default:
+                msgpack_pack_qore_value(writer, v, ctx, xsink); break;
+        }
+    }
+
+    mpack_finish_map(writer);
+}
+
+QoreValue MsgPackSchema::pack(ExceptionSink* xsink, const QoreHashNode* value) {
+    try {
+        msgpack::intern::PackContext ctx(mode);
+
+        // use the scratch buffer unless another thread is already packing with it
+        std::unique_lock<std::mutex> lock(scratchLock, std::try_to_lock);
+        msgpack::MsgPackBuffer tmp;
+        msgpack::MsgPackBuffer& buffer = lock.owns_lock() ? scratch : tmp;
+
+        mpack_writer_t writer;
+        msgpack::intern::msgpack_scratch_writer_init(&writer, buffer);
+        packHash(&writer, value, ctx, xsink);
+        QoreValue result(msgpack::intern::msgpack_scratch_writer_finish(&writer, buffer));
+        if (xsink && *xsink) {
+            result.discard(xsink);
+            return QoreValue();
+        }
+        return result;
+    }
+    catch (msgpack::MsgPackException ex) {
+        xsink->raiseException("PACK-ERROR", ex.err);
+    }
+    return QoreValue();
+}
+
+size_t MsgPackSchema::matchKey(mpack_reader_t* reader, size_t next, std::string& tmp) const {
+    mpack_tag_t tag = mpack_read_tag(reader);
+    if (mpack_tag_type(&tag) != mpack_type_str) {
+        mpack_reader_flag_error(reader, mpack_error_data);
+        return npos;
+    }
+
+    // read the key in place if possible
+    uint32_t len = mpack_tag_str_length(&tag);
+    const char* key;
+    if (mpack_should_read_bytes_inplace(reader, len)) {
+        key = mpack_read_bytes_inplace(reader, len);
+    }
+    else {
+        tmp.resize(len);
+        mpack_read_bytes(reader, &tmp[0], len);
+        key = tmp.data();
+    }
+    mpack_done_str(reader);
+    if (mpack_reader_error(reader) != mpack_ok)
+        return npos;
+
+    // keys usually follow the declaration order
+    if (next < fields.size() && fields[next].name.size() == len && !memcmp(fields[next].name.data(), key, len))
+        return next;
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (fields[i].name.size() == len && !memcmp(fields[i].name.data(), key, len))
+            return i;
+    }
+    return npos;
+}
+
+QoreValue MsgPackSchema::unpackField(mpack_reader_t* reader, const Field& field, msgpack::intern::UnpackContext& ctx, std::string& error, ExceptionSink* xsink) const {
+    mpack_tag_t tag = mpack_peek_tag(reader);
+    mpack_type_t type = mpack_tag_type(&tag);
+
+    // read scalars directly as the declared type
+    switch (field.type) {
+        case NT_INT:
+            if (type == mpack_type_int || type == mpack_type_uint)
+                return mpack_expect_i64(reader);
+            break;
+        case NT_FLOAT:
+            if (type == mpack_type_int || type == mpack_type_uint || type == mpack_type_float || type == mpack_type_double)
+                return mpack_expect_double(reader);
+            break;
+        case NT_BOOLEAN:
+            if (type == mpack_type_bool)
+                return mpack_expect_bool(reader);
+            break;
+        default:
+            break;
+    }
+
+    ValueHolder value(msgpack::intern::msgpack_unpack_value(reader, ctx, xsink), xsink);
+    if (mpack_reader_error(reader) != mpack_ok || value->getType() == field.type)
+        return value.release();
+
+    // members with complex types accept values assignable to the type
+    if (field.type == NT_NOTHING) {
+        if (field.typeInfo == autoTypeInfo || schema_type_accepts(field.typeInfo, schema_value_type(*value)))
+            return value.release();
+        if (value->getType() == NT_NULL && schema_type_accepts(field.typeInfo, nothingTypeInfo))
+            return QoreValue();
+        AbstractQoreNode* container = schema_convert_container(field, *value, xsink);
+        if (container)
+            return container;
+    }
+
+    switch (value->getType()) {
+        case NT_NOTHING:
+        case NT_NULL:
+            if (field.orNothing)
+                return QoreValue();
+            break;
+        case NT_INT:
+        case NT_FLOAT:
+            if (field.type == NT_NUMBER) {
+                if (value->getType() == NT_INT)
+                    return new QoreNumberNode(value->getAsBigInt());
+                return new QoreNumberNode(value->getAsFloat());
+            }
+            break;
+        default:
+            break;
+    }
+
+    // remember the first mismatch only
+    if (error.empty()) {
+        QoreString msg;
+        msg.sprintf("hashdecl '%s' member '%s' expects type '%s'; got type '%s'", hashdecl->getName(),
+            field.name.c_str(), qore_type_get_name(field.typeInfo), value->getTypeName());
+        error = msg.c_str();
+    }
+    mpack_reader_flag_error(reader, mpack_error_type);
+    return QoreValue();
+}
+
+QoreHashNode* MsgPackSchema::unpackHash(mpack_reader_t* reader, msgpack::intern::UnpackContext& ctx, std::string& error, ExceptionSink* xsink) const {
+    uint32_t size = mpack_expect_map(reader);
+    if (mpack_reader_error(reader) != mpack_ok)
+        return nullptr;
+
+    // members not present in the data keep their default values
+    ReferenceHolder<QoreHashNode> hash(new QoreHashNode(hashdecl, xsink), xsink);
+    if (*xsink)
+        return nullptr;
+
+    std::string tmp;
+    size_t next = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        size_t index = matchKey(reader, next, tmp);
+        if (mpack_reader_error(reader) != mpack_ok)
+            break;
+
+        // entries that are not hashdecl members are skipped
+        if (index == npos) {
+            mpack_discard(reader);
+            continue;
+        }
+
+        const Field& field = fields[index];
+        ValueHolder value(unpackField(reader, field, ctx, error, xsink), xsink);
+        if (mpack_reader_error(reader) != mpack_ok)
+            break;
+        hash->setKeyValue(field.name.c_str(), value.release(), xsink);
+        next = index + 1;
+    }
+
+    mpack_done_map(reader);
+    return hash.release();
+}
+
+QoreValue MsgPackSchema::unpack(ExceptionSink* xsink, const BinaryNode* data) const {
+    const char* buffer = static_cast<const char*>(data->getPtr());
+    size_t size = data->size();
+    if (!buffer || !size)
+        return QoreValue();
+
+    try {
+        msgpack::intern::UnpackContext ctx(mode);
+        std::string error;
+        ReferenceHolder<QoreListNode> list(xsink);
+        ReferenceHolder<QoreHashNode> hash(xsink);
+
+        mpack_reader_t reader;
+        mpack_reader_init_data(&reader, buffer, size);
+
+        // multiple top-level values are returned as a list
+        const char* dataCheck = nullptr;
+        do {
+            QoreHashNode* h = unpackHash(&reader, ctx, error, xsink);
+            if (hash) {
+                if (!list)
+                    list = new QoreListNode(autoTypeInfo);
+                list->push(hash.release(), xsink);
+            }
+            hash = h;
+        }
+        while (mpack_reader_remaining(&reader, &dataCheck) && dataCheck && mpack_reader_error(&reader) == mpack_ok);
+
+        mpack_error_t result = mpack_reader_destroy(&reader);
+        if (*xsink)
+            return QoreValue();
+        if (result != mpack_ok) {
+            if (!error.empty())
+                throw msgpack::MsgPackExceptionMaker("%s", error.c_str());
+            throw msgpack::getMsgPackException(result);
+        }
+
+        if (list) {
+            list->push(hash.release(), xsink);
+            return list.release();
+        }
+        return hash.release();
+    }
+    catch (msgpack::MsgPackException ex) {
+        xsink->raiseException("UNPACK-ERROR", ex.err);
+    }
+    return QoreValue();
+}
+
+} // namespace msgpack
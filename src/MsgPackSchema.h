@@ -0,0 +1,138 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    MsgPackSchema.h
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _QORE_MODULE_MSGPACK_MSGPACKSCHEMA_H
+#define _QORE_MODULE_MSGPACK_MSGPACKSCHEMA_H
+
+// std
+#include <mutex>
+#include <string>
+#include <vector>
+
+// qore
+#include "qore/Qore.h"
+
+// mpack library
+#include "mpack/mpack.h"
+
+// module sources
+#include "msgpack_enums.h"
+#include "msgpack_pack.h"
+#include "MsgPackBuffer.h"
+#include "msgpack_unpack.h"
+
+namespace msgpack {
+
+//! Pack and unpack plan compiled from a hashdecl.
+/**
+    Holds the members of the hashdecl in declaration order together with their
+    pre-encoded keys and declared value types. Packing a hash walks its entries
+    and the fields side by side: an entry matching the next field is written with
+    the pre-encoded key and, if the value has the declared type, directly with the
+    writer for that type. Other entries and values are packed the generic way.
+
+    Unpacking creates hashes of the hashdecl directly: keys are matched against the
+    fields (trying the next field in declaration order first) and values are read
+    as the declared type of the member. Values of members with complex types must
+    be assignable to the declared type; untyped lists and hashes are converted to
+    the declared container type if all their elements have its scalar element type.
+*/
+class MsgPackSchema : public AbstractPrivateData {
+public:
+    //! Compiled hashdecl member.
+    struct Field {
+        std::string name;
+        //! str header followed by the name; empty if the key cannot be pre-encoded
+        std::string key;
+        const QoreTypeInfo* typeInfo;
+        //! Node type of values with the declared type; NT_NOTHING if not known
+        qore_type_t type;
+        //! True if the declared type accepts NOTHING
+        bool orNothing;
+        //! Base type (NT_LIST or NT_HASH) of containers with a scalar element type; NT_NOTHING otherwise
+        qore_type_t containerType = NT_NOTHING;
+        //! Node type of the elements of such containers
+        qore_type_t elementType = NT_NOTHING;
+        //! Element type used to create the typed container from untyped data
+        const QoreTypeInfo* elementTypeInfo = nullptr;
+    };
+
+    //! Returned by matchKey() for keys that are not hashdecl members.
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+private:
+    //! The hashdecl of the example hash passed to MsgPack::compileSchema(); it is owned by the program
+    //! declaring it, which can be another program than the one creating the schema and is not kept
+    //! alive by the schema, so the schema must not be used after that program has been deleted
+    const TypedHashDecl* hashdecl;
+    msgpack::OperationMode mode;
+    std::vector<Field> fields;
+
+    //! Scratch buffer reused by pack() calls.
+    msgpack::MsgPackBuffer scratch;
+
+    //! Guards the scratch buffer; concurrent callers fall back to a private buffer.
+    std::mutex scratchLock;
+
+    //! Write the hash according to the plan.
+    DLLLOCAL void packHash(mpack_writer_t* writer, const QoreHashNode* value, msgpack::intern::PackContext& ctx, ExceptionSink* xsink) const;
+
+    //! Read a map key and return the index of the matching field (npos if there is none); \a next is tried first.
+    DLLLOCAL size_t matchKey(mpack_reader_t* reader, size_t next, std::string& tmp) const;
+
+    //! Read a value as the declared type of the field; sets \a error on type mismatches.
+    DLLLOCAL QoreValue unpackField(mpack_reader_t* reader, const Field& field, msgpack::intern::UnpackContext& ctx, std::string& error, ExceptionSink* xsink) const;
+
+    //! Read a map as a hash of the hashdecl.
+    DLLLOCAL QoreHashNode* unpackHash(mpack_reader_t* reader, msgpack::intern::UnpackContext& ctx, std::string& error, ExceptionSink* xsink) const;
+
+public:
+    //! Compile the plan for the passed hashdecl.
+    DLLLOCAL MsgPackSchema(const TypedHashDecl* hd, msgpack::OperationMode m);
+
+    //! Compile the plan for the hashdecl of the passed typed hash; raises SCHEMA-ERROR if the hash is untyped.
+    DLLLOCAL static MsgPackSchema* compile(ExceptionSink* xsink, const QoreHashNode* example, msgpack::OperationMode m);
+
+    //! Get operation mode used for packing.
+    DLLLOCAL msgpack::OperationMode getOperationMode() const { return mode; }
+
+    //! Get the hashdecl the plan was compiled from.
+    DLLLOCAL const TypedHashDecl* getHashDecl() const { return hashdecl; }
+
+    //! Get the compiled fields in declaration order.
+    DLLLOCAL const std::vector<Field>& getFields() const { return fields; }
+
+    //! Pack the passed hash according to the plan.
+    DLLLOCAL QoreValue pack(ExceptionSink* xsink, const QoreHashNode* value);
+
+    //! Unpack the passed data into hashes of the hashdecl.
+    DLLLOCAL QoreValue unpack(ExceptionSink* xsink, const BinaryNode* data) const;
+};
+
+} // namespace msgpack
+
+#endif // _QORE_MODULE_MSGPACK_MSGPACKSCHEMA_H
@@ -0,0 +1,126 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+  MsgPackStreamDecoder.cpp
+
+  Qore MessagePack module
+
+  Copyright (C) 2018 Qore Technologies, s.r.o.
+
+  Permission is hereby granted, free of charge, to any person obtaining a
+  copy of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom the
+  Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+// std
+#include <cstring>
+
+#include "MsgPackStreamDecoder.h"
+
+// module sources
+#include "msgpack_unpack.h"
+#include "MsgPackException.h"
+
+namespace msgpack {
+
+//----------------------------------
+// MsgPackStreamDecoder class
+//----------------------------------
+
+void MsgPackStreamDecoder::decode(QoreListNode* result, ExceptionSink* xsink) {
+    const char* data = pending.getBuffer();
+    size_t start = 0;
+
+    for (;;) {
+        // skip payload of the last scanned value
+        if (skip) {
+            size_t avail = size - offset;
+            size_t n = skip < avail ? static_cast<size_t>(skip) : avail;
+            offset += n;
+            skip -= n;
+            if (skip)
+                break;
+        }
+        else {
+            if (offset == size)
+                break;
+
+            // a new top-level value starts here
+            if (!items)
+                items = 1;
+
+            intern::ScanHeader hdr;
+            if (!intern::msgpack_scan_header(data + offset, size - offset, hdr))
+                break;
+            offset += hdr.size;
+            items += hdr.children - 1;
+            skip = hdr.payload;
+            if (skip)
+                continue;
+        }
+        if (items)
+            continue;
+
+        // the value is complete - decode it
+        mpack_reader_t reader;
+        mpack_reader_init_data(&reader, data + start, offset - start);
+        QoreValue node = intern::msgpack_unpack_value(&reader, mode, xsink);
+        mpack_error_t error = mpack_reader_destroy(&reader);
+        if (error != mpack_ok) {
+            node.discard(xsink);
+            throw getMsgPackException(error);
+        }
+        result->push(node, xsink);
+        if (*xsink)
+            return;
+        start = offset;
+    }
+
+    // keep only the bytes of the incomplete trailing value
+    if (start) {
+        size -= start;
+        offset -= start;
+        memmove(pending.getBuffer(), data + start, size);
+    }
+}
+
+QoreListNode* MsgPackStreamDecoder::feed(ExceptionSink* xsink, const BinaryNode* chunk) {
+    std::lock_guard<std::mutex> guard(lock);
+    ReferenceHolder<QoreListNode> result(new QoreListNode(autoTypeInfo), xsink);
+
+    try {
+        size_t len = chunk->size();
+        if (len) {
+            if (size + len > pending.getCapacity() && !pending.grow(size + len))
+                throw getMsgPackException(mpack_error_memory);
+            memcpy(pending.getBuffer() + size, chunk->getPtr(), len);
+            size += len;
+        }
+        decode(*result, xsink);
+    }
+    catch (MsgPackException ex) {
+        xsink->raiseException("UNPACK-ERROR", ex.err);
+    }
+
+    // the stream cannot be resynchronized after invalid data
+    if (*xsink) {
+        clear();
+        return nullptr;
+    }
+    return result.release();
+}
+
+} // namespace msgpack
@@ -0,0 +1,108 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    MsgPackStreamDecoder.h
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _QORE_MODULE_MSGPACK_MSGPACKSTREAMDECODER_H
+#define _QORE_MODULE_MSGPACK_MSGPACKSTREAMDECODER_H
+
+// std
+#include <cstdint>
+#include <mutex>
+
+// qore
+#include "qore/Qore.h"
+
+// module sources
+#include "msgpack_enums.h"
+#include "MsgPackBuffer.h"
+
+namespace msgpack {
+
+//! Incremental MessagePack decoder for chunked input.
+/**
+    Bytes are appended with feed(); complete top-level values are decoded as
+    soon as their last byte arrives, while the bytes of an incomplete trailing
+    value are kept for the next call. Value boundaries are found by a resumable
+    scanner which only walks the type headers, so bytes scanned by an earlier
+    call are never scanned or decoded again.
+*/
+class MsgPackStreamDecoder : public AbstractPrivateData {
+private:
+    msgpack::OperationMode mode;
+
+    //! Pending input bytes; the first \c size bytes are valid.
+    msgpack::MsgPackBuffer pending;
+    size_t size = 0;
+
+    //! Scanner state: position of the next header to scan.
+    size_t offset = 0;
+
+    //! Scanner state: number of values still missing to complete the current top-level value.
+    uint64_t items = 0;
+
+    //! Scanner state: number of payload bytes still to skip.
+    uint64_t skip = 0;
+
+    std::mutex lock;
+
+    //! Scan the pending bytes and decode all complete values into \a result.
+    DLLLOCAL void decode(QoreListNode* result, ExceptionSink* xsink);
+
+    //! Drop all pending bytes and reset the scanner.
+    DLLLOCAL void clear() {
+        size = 0;
+        offset = 0;
+        items = 0;
+        skip = 0;
+    }
+
+public:
+    //! Constructor.
+    DLLLOCAL MsgPackStreamDecoder(msgpack::OperationMode m = msgpack::MSGPACK_SIMPLE_MODE) : mode(m) {}
+
+    //! Get operation mode used for unpacking.
+    DLLLOCAL msgpack::OperationMode getOperationMode() const { return mode; }
+
+    //! Feed a chunk of data and return a list of all values completed by it.
+    DLLLOCAL QoreListNode* feed(ExceptionSink* xsink, const BinaryNode* chunk);
+
+    //! Get the number of buffered bytes belonging to an incomplete value.
+    DLLLOCAL size_t getPendingSize() {
+        std::lock_guard<std::mutex> guard(lock);
+        return size;
+    }
+
+    //! Discard any buffered incomplete value.
+    DLLLOCAL void reset() {
+        std::lock_guard<std::mutex> guard(lock);
+        clear();
+        pending.reset();
+    }
+};
+
+} // namespace msgpack
+
+#endif // _QORE_MODULE_MSGPACK_MSGPACKSTREAMDECODER_H
@@ -0,0 +1,108 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    MsgPackWorkStack.h
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _QORE_MODULE_MSGPACK_MSGPACKWORKSTACK_H
+#define _QORE_MODULE_MSGPACK_MSGPACKWORKSTACK_H
+
+// std
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+// qore
+#include "qore/Qore.h"
+
+namespace msgpack {
+
+//! Explicit work stack used by the iterative pack and unpack engines instead of native recursion.
+/**
+    The first InlineSize frames are kept in the object itself, so that shallow data
+    is processed without any allocation; deeper frames are stored in heap chunks of
+    ChunkSize frames that are kept until the stack is destroyed. Frames are
+    constructed in place and never move, so they may hold non-copyable members and
+    references to them stay valid while other frames are pushed.
+*/
+template <typename T, size_t InlineSize = 16, size_t ChunkSize = 256>
+class MsgPackWorkStack {
+public:
+    DLLLOCAL MsgPackWorkStack() {}
+
+    DLLLOCAL ~MsgPackWorkStack() {
+        while (count)
+            pop();
+        for (void* chunk : chunks)
+            ::operator delete(chunk);
+    }
+
+    MsgPackWorkStack(const MsgPackWorkStack&) = delete;
+    MsgPackWorkStack& operator=(const MsgPackWorkStack&) = delete;
+
+    //! Construct a new frame on top of the stack.
+    template <typename... Args>
+    DLLLOCAL T& push(Args&&... args) {
+        T* frame = new (slot(count)) T(std::forward<Args>(args)...);
+        ++count;
+        last = frame;
+        return *frame;
+    }
+
+    //! Destroy the frame on top of the stack.
+    DLLLOCAL void pop() {
+        last->~T();
+        last = --count ? static_cast<T*>(slot(count - 1)) : nullptr;
+    }
+
+    //! Get the frame on top of the stack.
+    DLLLOCAL T& top() const { return *last; }
+
+    //! Get the number of frames.
+    DLLLOCAL size_t size() const { return count; }
+
+    DLLLOCAL bool empty() const { return !count; }
+
+private:
+    alignas(T) unsigned char inlineFrames[InlineSize * sizeof(T)];
+    std::vector<void*> chunks;
+    size_t count = 0;
+    T* last = nullptr;
+
+    //! Returns the storage of the frame with the passed index, allocating a new chunk if needed.
+    DLLLOCAL void* slot(size_t i) {
+        if (i < InlineSize)
+            return inlineFrames + i * sizeof(T);
+        i -= InlineSize;
+        size_t chunk = i / ChunkSize;
+        if (chunk == chunks.size())
+            chunks.push_back(::operator new(ChunkSize * sizeof(T)));
+        return static_cast<char*>(chunks[chunk]) + (i % ChunkSize) * sizeof(T);
+    }
+};
+
+} // namespace msgpack
+
+#endif // _QORE_MODULE_MSGPACK_MSGPACKWORKSTACK_H
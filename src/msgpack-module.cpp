@@ -34,7 +34,11 @@
 
 // module sources
 #include "QC_MsgPack.h"
+#include "QC_MsgPackDocument.h"
 #include "QC_MsgPackExtension.h"
+#include "QC_MsgPackIterator.h"
+#include "QC_MsgPackSchema.h"
+#include "QC_MsgPackStreamDecoder.h"
 
 void init_msgpack_functions(QoreNamespace& ns);
 void init_msgpack_constants(QoreNamespace& ns);
@@ -61,8 +65,13 @@ DLLEXPORT char qore_module_license_str[] = "MIT";
 QoreNamespace MsgPackNS("Qore::msgpack");
 
 QoreStringNode* msgpack_module_init() {
+    // MsgPackSchema must be initialized before MsgPack, which returns it
+    MsgPackNS.addSystemClass(initMsgPackSchemaClass(MsgPackNS));
     MsgPackNS.addSystemClass(initMsgPackClass(MsgPackNS));
+    MsgPackNS.addSystemClass(initMsgPackDocumentClass(MsgPackNS));
     MsgPackNS.addSystemClass(initMsgPackExtensionClass(MsgPackNS));
+    MsgPackNS.addSystemClass(initMsgPackIteratorClass(MsgPackNS));
+    MsgPackNS.addSystemClass(initMsgPackStreamDecoderClass(MsgPackNS));
     init_msgpack_functions(MsgPackNS);
     init_msgpack_constants(MsgPackNS);
 
@@ -28,13 +28,21 @@
 #include "msgpack_extensions.h"
 
 // std
+#include <cstdlib>
+#include <cstring>
 #include <cmath>
+#include <algorithm>
 #include <cstdint>
 #include <memory>
 #include <limits>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // module sources
 #include "msgpack_enums.h"
+#include "msgpack_pack.h"
 
 namespace msgpack {
 namespace intern {
@@ -123,22 +131,142 @@ void msgpack_pack_ext_null(mpack_writer_t* writer) {
     mpack_write_ext(writer, (int8_t) MSGPACK_EXT_QORE_NULL, "", 0);
 }
 
-void msgpack_pack_ext_number(mpack_writer_t* writer, const QoreNumberNode* number) {
+// Powers of ten used by the decimal number subtype; all of them are exact doubles.
+static const int64 number_pow10[MSGPACK_NUMBER_MAX_SCALE + 1] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL, 1000000000LL,
+    10000000000LL, 100000000000LL, 1000000000000LL, 10000000000000LL, 100000000000000LL,
+    1000000000000000LL, 10000000000000000LL, 100000000000000000LL, 1000000000000000000LL,
+};
+
+// Creates the number coefficient * 10^-scale.
+static QoreNumberNode* msgpack_make_decimal_number(int64 coefficient, int scale, ExceptionSink* xsink) {
+    SimpleRefHolder<QoreNumberNode> value(new QoreNumberNode(coefficient));
+    if (!scale)
+        return value.release();
+    SimpleRefHolder<QoreNumberNode> divisor(new QoreNumberNode(number_pow10[scale]));
+    return value->doDivideBy(**divisor, xsink);
+}
+
+// Returns the precision of numbers unpacked from the decimal number subtype.
+static unsigned msgpack_decimal_number_prec() {
+    ExceptionSink xsink;
+    SimpleRefHolder<QoreNumberNode> value(msgpack_make_decimal_number(1, 1, &xsink));
+    return value ? value->getPrec() : 0;
+}
+
+// Finds the coefficient and scale of the decimal number subtype from \a str, the string form of the number
+// written by the normal number subtype; returns false if the number cannot be written as a decimal number.
+static bool msgpack_number_decimal(const QoreNumberNode* number, const QoreString& str, int64& coefficient, int& scale) {
+    // unpacked decimal numbers have the default precision
+    static const unsigned decimalPrec = msgpack_decimal_number_prec();
+    if (number->getPrec() != decimalPrec)
+        return false;
+
+    // the string has the form "[-]d.ddde[+-]x" with enough digits to be read back as the same number,
+    // so the decimal number given by its digits is unpacked as the same number too
+    const char* p = str.c_str();
+    const char* end = p + str.size();
+    bool negative = (p < end && *p == '-');
+    if (negative)
+        ++p;
+    const char* e = static_cast<const char*>(memchr(p, 'e', end - p));
+    if (!e)
+        return false;
+    char* expEnd;
+    long exponent = strtol(e + 1, &expEnd, 10);
+    if (expEnd != end)
+        return false;
+
+    // trailing zeros do not change the value
+    while (e > p && (e[-1] == '0' || e[-1] == '.'))
+        --e;
+
+    uint64_t digits = 0;
+    long fraction = 0;
+    int count = 0;
+    bool point = false;
+    for (; p < e; ++p) {
+        if (*p == '.') {
+            point = true;
+            continue;
+        }
+        // 19 digits always fit into 64 bits
+        if (*p < '0' || *p > '9' || ++count > 19)
+            return false;
+        digits = digits * 10 + static_cast<uint64_t>(*p - '0');
+        if (point)
+            ++fraction;
+    }
+
+    long s = fraction - exponent;
+    if (s > MSGPACK_NUMBER_MAX_SCALE)
+        return false;
+    for (; s < 0; ++s) {
+        if (digits > UINT64_MAX / 10)
+            return false;
+        digits *= 10;
+    }
+    // the sign of negative zero would be lost
+    if (digits > static_cast<uint64_t>(INT64_MAX) || (negative && !digits))
+        return false;
+
+    coefficient = negative ? -static_cast<int64>(digits) : static_cast<int64>(digits);
+    scale = static_cast<int>(s);
+    return true;
+}
+
+// Returns the size of the coefficient of the decimal number subtype.
+static uint32_t msgpack_number_coefficient_size(int64 coefficient) {
+    if (coefficient >= INT8_MIN && coefficient <= INT8_MAX)
+        return 1;
+    if (coefficient >= INT16_MIN && coefficient <= INT16_MAX)
+        return 2;
+    if (coefficient >= INT32_MIN && coefficient <= INT32_MAX)
+        return 4;
+    return 8;
+}
+
+void msgpack_pack_ext_number(mpack_writer_t* writer, const QoreNumberNode* number, bool decimal, MsgPackNumberEncodings* encodings) {
     if (number->nan()) {
         mpack_start_ext(writer, (int8_t) MSGPACK_EXT_QORE_NUMBER, 1);
         char numberType = (char) MSGPACK_NUMBER_NAN;
         mpack_write_bytes(writer, &numberType, 1);
+        mpack_finish_ext(writer);
+        return;
     }
-    else if (number->inf()) {
+    if (number->inf()) {
         mpack_start_ext(writer, (int8_t) MSGPACK_EXT_QORE_NUMBER, 1);
         char numberType = (number->sign() > 0) ? (char) MSGPACK_NUMBER_INF : (char) MSGPACK_NUMBER_NINF;
         mpack_write_bytes(writer, &numberType, 1);
+        mpack_finish_ext(writer);
+        return;
     }
-    else {
-        // prepare number string
-        QoreString str(QCS_USASCII);
+
+    // prepare number string unless the sizing pass has already found the decimal encoding
+    QoreString str(QCS_USASCII);
+    int64 coefficient = 0;
+    int scale = -1;
+    if (!decimal || !encodings || !encodings->next(number, coefficient, scale) || scale < 0) {
         number->toString(str, QORE_NF_SCIENTIFIC|QORE_NF_RAW);
+        if (!decimal || !msgpack_number_decimal(number, str, coefficient, scale))
+            scale = -1;
+    }
 
+    if (scale >= 0) {
+        uint32_t size = msgpack_number_coefficient_size(coefficient);
+        char bytes[2 + sizeof(int64_t)];
+        bytes[0] = (char) MSGPACK_NUMBER_DECIMAL;
+        bytes[1] = (char) scale;
+        switch (size) {
+            case 1: mpack_store_i8(bytes + 2, static_cast<int8_t>(coefficient)); break;
+            case 2: mpack_store_i16(bytes + 2, static_cast<int16_t>(coefficient)); break;
+            case 4: mpack_store_i32(bytes + 2, static_cast<int32_t>(coefficient)); break;
+            default: mpack_store_i64(bytes + 2, coefficient); break;
+        }
+        mpack_start_ext(writer, (int8_t) MSGPACK_EXT_QORE_NUMBER, 2 + size);
+        mpack_write_bytes(writer, bytes, 2 + size);
+    }
+    else {
         // get precision
         uint32_t prec = number->getPrec();
 
@@ -182,6 +310,181 @@ void msgpack_pack_ext_timestamp(mpack_writer_t* writer, const DateTimeNode* date
 }
 
 
+// Number of elements converted at once by the typed array kernels.
+static constexpr size_t TYPED_ARRAY_CHUNK = 512;
+
+bool msgpack_float32_exact_all(const double* values, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // check two values at once by converting them to float32 and back; finite values out of
+    // the float range become infinities and NaNs never compare equal, so both are rejected
+    __m128d exact = _mm_castsi128_pd(_mm_set1_epi32(-1));
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_loadu_pd(values + i);
+        exact = _mm_and_pd(exact, _mm_cmpeq_pd(v, _mm_cvtps_pd(_mm_cvtpd_ps(v))));
+    }
+    if (_mm_movemask_pd(exact) != 3)
+        return false;
+#endif
+    for (; i < count; ++i) {
+        if (!msgpack_float32_exact(values[i]))
+            return false;
+    }
+    return true;
+}
+
+bool msgpack_float32_list(const QoreListNode* list) {
+    size_t count = list->size();
+    double buf[TYPED_ARRAY_CHUNK];
+    for (size_t i = 0; i < count; i += TYPED_ARRAY_CHUNK) {
+        size_t n = std::min(TYPED_ARRAY_CHUNK, count - i);
+        for (size_t j = 0; j < n; ++j)
+            buf[j] = list->retrieveEntry(i + j).getAsFloat();
+        if (!msgpack_float32_exact_all(buf, n))
+            return false;
+    }
+    return true;
+}
+
+bool msgpack_typed_array_type(const QoreListNode* list, TypedArrayExtensionType& type, bool compactFloats) {
+    const QoreTypeInfo* elementType = list->getValueTypeInfo();
+    size_t count = list->size();
+
+    if (elementType == floatTypeInfo) {
+        type = (compactFloats && msgpack_float32_list(list)) ? MSGPACK_TYPED_ARRAY_FLOAT32 : MSGPACK_TYPED_ARRAY_FLOAT64;
+    }
+    else if (elementType == bigIntTypeInfo) {
+        // find the narrowest integer type holding all elements
+        int64 min = 0, max = 0;
+        for (size_t i = 0; i < count; ++i) {
+            int64 v = list->retrieveEntry(i).getAsBigInt();
+            if (v < min)
+                min = v;
+            else if (v > max)
+                max = v;
+        }
+        if (min >= INT8_MIN && max <= INT8_MAX)
+            type = MSGPACK_TYPED_ARRAY_INT8;
+        else if (min >= INT16_MIN && max <= INT16_MAX)
+            type = MSGPACK_TYPED_ARRAY_INT16;
+        else if (min >= INT32_MIN && max <= INT32_MAX)
+            type = MSGPACK_TYPED_ARRAY_INT32;
+        else
+            type = MSGPACK_TYPED_ARRAY_INT64;
+    }
+    else {
+        return false;
+    }
+
+    // the whole array must fit into a single extension
+    return count <= (UINT32_MAX - 1) / msgpack_typed_array_element_size(type);
+}
+
+// Stores the elements [start, start + count) of the list into buf in big-endian order.
+static void msgpack_store_typed_array_chunk(char* buf, const QoreListNode* list, size_t start, size_t count, TypedArrayExtensionType type) {
+    switch (type) {
+        case MSGPACK_TYPED_ARRAY_INT8:
+            for (size_t i = 0; i < count; ++i)
+                mpack_store_i8(buf + i, static_cast<int8_t>(list->retrieveEntry(start + i).getAsBigInt()));
+            break;
+        case MSGPACK_TYPED_ARRAY_INT16:
+            for (size_t i = 0; i < count; ++i)
+                mpack_store_i16(buf + i * 2, static_cast<int16_t>(list->retrieveEntry(start + i).getAsBigInt()));
+            break;
+        case MSGPACK_TYPED_ARRAY_INT32:
+            for (size_t i = 0; i < count; ++i)
+                mpack_store_i32(buf + i * 4, static_cast<int32_t>(list->retrieveEntry(start + i).getAsBigInt()));
+            break;
+        case MSGPACK_TYPED_ARRAY_INT64:
+            for (size_t i = 0; i < count; ++i)
+                mpack_store_i64(buf + i * 8, list->retrieveEntry(start + i).getAsBigInt());
+            break;
+        case MSGPACK_TYPED_ARRAY_FLOAT64:
+            for (size_t i = 0; i < count; ++i)
+                mpack_store_double(buf + i * 8, list->retrieveEntry(start + i).getAsFloat());
+            break;
+        case MSGPACK_TYPED_ARRAY_FLOAT32:
+            for (size_t i = 0; i < count; ++i)
+                mpack_store_float(buf + i * 4, static_cast<float>(list->retrieveEntry(start + i).getAsFloat()));
+            break;
+    }
+}
+
+void msgpack_pack_ext_typed_array(mpack_writer_t* writer, const QoreListNode* list, TypedArrayExtensionType type) {
+    size_t count = list->size();
+    size_t elementSize = msgpack_typed_array_element_size(type);
+    char arrayType = static_cast<char>(type);
+
+    mpack_start_ext(writer, (int8_t) MSGPACK_EXT_QORE_TYPED_ARRAY, static_cast<uint32_t>(1 + count * elementSize));
+    mpack_write_bytes(writer, &arrayType, 1);
+
+    // convert the elements in chunks and write each chunk at once
+    char buf[TYPED_ARRAY_CHUNK * 8];
+    for (size_t i = 0; i < count; i += TYPED_ARRAY_CHUNK) {
+        size_t n = std::min(TYPED_ARRAY_CHUNK, count - i);
+        msgpack_store_typed_array_chunk(buf, list, i, n, type);
+        mpack_write_bytes(writer, buf, n * elementSize);
+    }
+    mpack_finish_ext(writer);
+}
+
+//----------------------------
+// Extension sizing functions
+//----------------------------
+
+size_t msgpack_size_ext_date(const DateTimeNode* date) {
+    if (date->isAbsolute())
+        return msgpack_size_ext(1 + sizeof(int64_t) + 2*sizeof(int32_t));
+    return msgpack_size_ext(1 + 7*sizeof(int32_t));
+}
+
+size_t msgpack_size_ext_ext(const MsgPackExtension* ext) {
+    return msgpack_size_ext(ext->getSize());
+}
+
+size_t msgpack_size_ext_null() {
+    return msgpack_size_ext(0);
+}
+
+size_t msgpack_size_ext_number(const QoreNumberNode* number, bool decimal, MsgPackNumberEncodings* encodings) {
+    if (number->nan() || number->inf())
+        return msgpack_size_ext(1);
+
+    QoreString str(QCS_USASCII);
+    number->toString(str, QORE_NF_SCIENTIFIC|QORE_NF_RAW);
+    if (decimal) {
+        int64 coefficient = 0;
+        int scale;
+        if (!msgpack_number_decimal(number, str, coefficient, scale))
+            scale = -1;
+        if (encodings)
+            encodings->add(number, coefficient, scale);
+        if (scale >= 0)
+            return msgpack_size_ext(2 + msgpack_number_coefficient_size(coefficient));
+    }
+    return msgpack_size_ext(1 + sizeof(uint32_t) + str.size());
+}
+
+size_t msgpack_size_ext_string(const QoreString* str) {
+    return msgpack_size_ext(str->size() + 1);
+}
+
+size_t msgpack_size_ext_timestamp(const DateTimeNode* date) {
+    int64_t seconds = date->getEpochSecondsUTC();
+    int32_t ns = date->getMicrosecond() * 1000;
+
+    if (seconds < 0 || seconds >= (INT64_C(1) << 34))
+        return MPACK_EXT_SIZE_TIMESTAMP12;
+    if (seconds > UINT32_MAX || ns > 0)
+        return MPACK_EXT_SIZE_TIMESTAMP8;
+    return MPACK_EXT_SIZE_TIMESTAMP4;
+}
+
+size_t msgpack_size_ext_typed_array(const QoreListNode* list, TypedArrayExtensionType type) {
+    return msgpack_size_ext(static_cast<uint32_t>(1 + list->size() * msgpack_typed_array_element_size(type)));
+}
+
+
 //-------------------------------
 // Extension unpacking functions
 //-------------------------------
@@ -286,6 +589,37 @@ AbstractQoreNode* msgpack_unpack_ext_number(mpack_reader_t* reader, mpack_tag_t
             result = new QoreNumberNode(str.get(), prec);
             break;
         }
+        case MSGPACK_NUMBER_DECIMAL: {
+            // 1B numberType + 1B scale + 1, 2, 4 or 8B coefficient
+            uint32_t size = mpack_tag_ext_length(&tag);
+            if (size != 3 && size != 4 && size != 6 && size != 10) {
+                mpack_reader_flag_error(reader, mpack_error_data);
+                mpack_done_ext(reader);
+                return nullptr;
+            }
+
+            // read scale and coefficient
+            char bytes[1 + sizeof(int64_t)];
+            mpack_read_bytes(reader, bytes, size - 1);
+            if (mpack_reader_error(reader) != mpack_ok)
+                return nullptr;
+            int scale = static_cast<unsigned char>(bytes[0]);
+            if (scale > MSGPACK_NUMBER_MAX_SCALE) {
+                mpack_reader_flag_error(reader, mpack_error_data);
+                mpack_done_ext(reader);
+                return nullptr;
+            }
+
+            int64 coefficient;
+            switch (size) {
+                case 3: coefficient = mpack_load_i8(bytes + 1); break;
+                case 4: coefficient = mpack_load_i16(bytes + 1); break;
+                case 6: coefficient = mpack_load_i32(bytes + 1); break;
+                default: coefficient = mpack_load_i64(bytes + 1); break;
+            }
+            result = msgpack_make_decimal_number(coefficient, scale, xsink);
+            break;
+        }
         default:
             mpack_reader_flag_error(reader, mpack_error_data);
             mpack_done_ext(reader);
@@ -324,5 +658,78 @@ AbstractQoreNode* msgpack_unpack_ext_string(mpack_reader_t* reader, mpack_tag_t
     return str.release();
 }
 
+bool msgpack_unpack_typed_array_header(mpack_reader_t* reader, mpack_tag_t tag, TypedArrayExtensionType& type, size_t& count) {
+    uint32_t size = mpack_tag_ext_length(&tag);
+    if (size < 1) {
+        mpack_reader_flag_error(reader, mpack_error_data);
+        return false;
+    }
+
+    // read array type and check the size of the element data
+    char arrayType;
+    mpack_read_bytes(reader, &arrayType, 1);
+    size_t elementSize = msgpack_typed_array_element_size(arrayType);
+    if (mpack_reader_error(reader) != mpack_ok || !elementSize || (size - 1) % elementSize) {
+        mpack_reader_flag_error(reader, mpack_error_data);
+        return false;
+    }
+    count = (size - 1) / elementSize;
+    type = static_cast<TypedArrayExtensionType>(arrayType);
+    return true;
+}
+
+AbstractQoreNode* msgpack_unpack_typed_array_elements(mpack_reader_t* reader, TypedArrayExtensionType type, size_t count, ExceptionSink* xsink) {
+    size_t elementSize = msgpack_typed_array_element_size(type);
+    bool floats = type == MSGPACK_TYPED_ARRAY_FLOAT64 || type == MSGPACK_TYPED_ARRAY_FLOAT32;
+    ReferenceHolder<QoreListNode> list(new QoreListNode(floats ? floatTypeInfo : bigIntTypeInfo), xsink);
+
+    // read the elements in chunks and convert each chunk at once
+    char buf[TYPED_ARRAY_CHUNK * 8];
+    for (size_t i = 0; i < count; i += TYPED_ARRAY_CHUNK) {
+        size_t n = std::min(TYPED_ARRAY_CHUNK, count - i);
+        mpack_read_bytes(reader, buf, n * elementSize);
+        if (mpack_reader_error(reader) != mpack_ok)
+            return nullptr;
+
+        switch (type) {
+            case MSGPACK_TYPED_ARRAY_INT8:
+                for (size_t j = 0; j < n; ++j)
+                    list->push(static_cast<int64>(mpack_load_i8(buf + j)), xsink);
+                break;
+            case MSGPACK_TYPED_ARRAY_INT16:
+                for (size_t j = 0; j < n; ++j)
+                    list->push(static_cast<int64>(mpack_load_i16(buf + j * 2)), xsink);
+                break;
+            case MSGPACK_TYPED_ARRAY_INT32:
+                for (size_t j = 0; j < n; ++j)
+                    list->push(static_cast<int64>(mpack_load_i32(buf + j * 4)), xsink);
+                break;
+            case MSGPACK_TYPED_ARRAY_INT64:
+                for (size_t j = 0; j < n; ++j)
+                    list->push(static_cast<int64>(mpack_load_i64(buf + j * 8)), xsink);
+                break;
+            case MSGPACK_TYPED_ARRAY_FLOAT64:
+                for (size_t j = 0; j < n; ++j)
+                    list->push(mpack_load_double(buf + j * 8), xsink);
+                break;
+            case MSGPACK_TYPED_ARRAY_FLOAT32:
+                for (size_t j = 0; j < n; ++j)
+                    list->push(static_cast<double>(mpack_load_float(buf + j * 4)), xsink);
+                break;
+        }
+    }
+
+    mpack_done_ext(reader);
+    return list.release();
+}
+
+AbstractQoreNode* msgpack_unpack_ext_typed_array(mpack_reader_t* reader, mpack_tag_t tag, ExceptionSink* xsink) {
+    TypedArrayExtensionType type;
+    size_t count;
+    if (!msgpack_unpack_typed_array_header(reader, tag, type, count))
+        return nullptr;
+    return msgpack_unpack_typed_array_elements(reader, type, count, xsink);
+}
+
 } // namespace intern
 } // namespace msgpack
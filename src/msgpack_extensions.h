@@ -28,6 +28,9 @@
 #ifndef _QORE_MODULE_MSGPACK_MSGPACK_EXTENSIONS_H
 #define _QORE_MODULE_MSGPACK_MSGPACK_EXTENSIONS_H
 
+// std
+#include <vector>
+
 // qore
 #include "qore/Qore.h"
 
@@ -45,6 +48,7 @@ enum QoreExtensionType {
     MSGPACK_EXT_QORE_DATE   = 1,
     MSGPACK_EXT_QORE_NUMBER = 2,
     MSGPACK_EXT_QORE_STRING = 3,
+    MSGPACK_EXT_QORE_TYPED_ARRAY = 4,
 };
 
 enum NumberExtensionType {
@@ -52,10 +56,109 @@ enum NumberExtensionType {
     MSGPACK_NUMBER_INF  = 1,
     MSGPACK_NUMBER_NINF = 2,
     MSGPACK_NUMBER_NORM = 3,
+    MSGPACK_NUMBER_DECIMAL = 4,
+};
+
+enum TypedArrayExtensionType {
+    MSGPACK_TYPED_ARRAY_INT8    = 0,
+    MSGPACK_TYPED_ARRAY_INT16   = 1,
+    MSGPACK_TYPED_ARRAY_INT32   = 2,
+    MSGPACK_TYPED_ARRAY_INT64   = 3,
+    MSGPACK_TYPED_ARRAY_FLOAT64 = 4,
+    MSGPACK_TYPED_ARRAY_FLOAT32 = 5,
 };
 
 namespace intern {
 
+//! Maximum number of decimal places of numbers in the decimal number subtype.
+constexpr int MSGPACK_NUMBER_MAX_SCALE = 18;
+
+//! Decimal encodings of numbers found while sizing a value, reused when the value is packed.
+/**
+    Finding the decimal encoding of a number needs formatting it as a string, so the sizing
+    pass records the result for each number and the following pack pass takes the results
+    in the same order instead of formatting decimal numbers again.
+*/
+class MsgPackNumberEncodings {
+public:
+    //! Record the encoding of the next number; \a scale is negative if it is not a decimal number.
+    DLLLOCAL void add(const QoreNumberNode* number, int64 coefficient, int scale) {
+        entries.push_back(Entry{number, coefficient, scale});
+    }
+
+    //! Take the recorded encoding of the next number; returns false if the number has not been recorded.
+    DLLLOCAL bool next(const QoreNumberNode* number, int64& coefficient, int& scale) {
+        if (index >= entries.size() || entries[index].number != number)
+            return false;
+        coefficient = entries[index].coefficient;
+        scale = entries[index].scale;
+        ++index;
+        return true;
+    }
+
+private:
+    struct Entry {
+        const QoreNumberNode* number;
+        int64 coefficient;
+        int scale;
+    };
+
+    std::vector<Entry> entries;
+    size_t index = 0;
+};
+
+//! Float32 compaction of float lists found while sizing a value, reused when the value is packed.
+/**
+    Whether all elements of a \c list<float> convert to float32 without loss is checked with
+    a vectorized pass over the whole list, so the sizing pass records the result for each
+    list and the following pack pass takes the results in the same order instead of
+    checking the elements again.
+*/
+class MsgPackFloatListEncodings {
+public:
+    //! Record whether all elements of the next list convert to float32 without loss.
+    DLLLOCAL void add(const QoreListNode* list, bool float32) {
+        entries.push_back(Entry{list, float32});
+    }
+
+    //! Take the recorded result of the next list; returns false if the list has not been recorded.
+    DLLLOCAL bool next(const QoreListNode* list, bool& float32) {
+        if (index >= entries.size() || entries[index].list != list)
+            return false;
+        float32 = entries[index].float32;
+        ++index;
+        return true;
+    }
+
+private:
+    struct Entry {
+        const QoreListNode* list;
+        bool float32;
+    };
+
+    std::vector<Entry> entries;
+    size_t index = 0;
+};
+
+//! Returns the size of a single element of the typed array type; 0 if the type is invalid.
+DLLLOCAL inline size_t msgpack_typed_array_element_size(int type) {
+    switch (type) {
+        case MSGPACK_TYPED_ARRAY_INT8:
+            return 1;
+        case MSGPACK_TYPED_ARRAY_INT16:
+            return 2;
+        case MSGPACK_TYPED_ARRAY_INT32:
+        case MSGPACK_TYPED_ARRAY_FLOAT32:
+            return 4;
+        case MSGPACK_TYPED_ARRAY_INT64:
+        case MSGPACK_TYPED_ARRAY_FLOAT64:
+            return 8;
+        default:
+            break;
+    }
+    return 0;
+}
+
 //-----------------------------
 // Extension packing functions
 //-----------------------------
@@ -121,8 +224,21 @@ DLLLOCAL void msgpack_pack_ext_null(mpack_writer_t* writer);
     +-----------------------+-------------+-----------------+
     |          1B           |     4B      |      1+ B       |
     @endverbatim
+
+    Decimal numbers (value = coefficient * 10^-scale):
+    @verbatim
+    +--------------------------+---------+-------------------+
+    |  MSGPACK_NUMBER_DECIMAL  |  scale  |    coefficient    |
+    +--------------------------+---------+-------------------+
+    |            1B            |   1B    |  1, 2, 4 or 8 B   |
+    @endverbatim
+
+    If \a decimal is set, numbers with the default precision are written as decimal
+    numbers if the digits of their normal number string give a coefficient fitting
+    into a signed 64 bit integer (stored in the narrowest of the 8, 16, 32 and 64 bit
+    types) and a scale of at most MSGPACK_NUMBER_MAX_SCALE.
 */
-DLLLOCAL void msgpack_pack_ext_number(mpack_writer_t* writer, const QoreNumberNode* number);
+DLLLOCAL void msgpack_pack_ext_number(mpack_writer_t* writer, const QoreNumberNode* number, bool decimal = false, MsgPackNumberEncodings* encodings = nullptr);
 
 /*
     Qore string extension type uses the following format:
@@ -140,6 +256,49 @@ DLLLOCAL void msgpack_pack_ext_string(mpack_writer_t* writer, const QoreString*
 
 DLLLOCAL void msgpack_pack_ext_timestamp(mpack_writer_t* writer, const DateTimeNode* date);
 
+/*
+    Qore typed array extension type is used for lists declared as list<int> or
+    list<float> and uses the following format:
+    (all data saved in network byte order - big-endian)
+
+    @verbatim
+    +--------------+--------------------------+
+    |  array type  |   ... element data ...   |
+    +--------------+--------------------------+
+    |      1B      |  count * element size B  |
+    @endverbatim
+
+    Integer lists use the narrowest of the 8, 16, 32 and 64 bit array types that
+    holds all of their elements. Float lists use the 32 bit array type if float
+    compaction is enabled and all of their elements convert to float32 without loss.
+*/
+
+//! Check whether the list can be packed as a typed array and get the array type to use.
+DLLLOCAL bool msgpack_typed_array_type(const QoreListNode* list, TypedArrayExtensionType& type, bool compactFloats = false);
+
+//! Check whether all values convert to float32 without loss.
+DLLLOCAL bool msgpack_float32_exact_all(const double* values, size_t count);
+
+//! Check whether all elements of a float list convert to float32 without loss.
+DLLLOCAL bool msgpack_float32_list(const QoreListNode* list);
+
+DLLLOCAL void msgpack_pack_ext_typed_array(mpack_writer_t* writer, const QoreListNode* list, TypedArrayExtensionType type);
+
+//----------------------------
+// Extension sizing functions
+//----------------------------
+
+// each returns the exact number of bytes written by the matching packing function
+
+DLLLOCAL size_t msgpack_size_ext_date(const DateTimeNode* date);
+DLLLOCAL size_t msgpack_size_ext_ext(const MsgPackExtension* ext);
+DLLLOCAL size_t msgpack_size_ext_null();
+//! Returns the size of the number extension; with \a decimal set, the decimal encoding is recorded in \a encodings if passed.
+DLLLOCAL size_t msgpack_size_ext_number(const QoreNumberNode* number, bool decimal = false, MsgPackNumberEncodings* encodings = nullptr);
+DLLLOCAL size_t msgpack_size_ext_string(const QoreString* str);
+DLLLOCAL size_t msgpack_size_ext_timestamp(const DateTimeNode* date);
+DLLLOCAL size_t msgpack_size_ext_typed_array(const QoreListNode* list, TypedArrayExtensionType type);
+
 //-------------------------------
 // Extension unpacking functions
 //-------------------------------
@@ -152,6 +311,12 @@ DLLLOCAL AbstractQoreNode* msgpack_unpack_ext_date(mpack_reader_t* reader, mpack
 DLLLOCAL AbstractQoreNode* msgpack_unpack_ext_null(mpack_reader_t* reader, mpack_tag_t tag, ExceptionSink* xsink);
 DLLLOCAL AbstractQoreNode* msgpack_unpack_ext_number(mpack_reader_t* reader, mpack_tag_t tag, ExceptionSink* xsink);
 DLLLOCAL AbstractQoreNode* msgpack_unpack_ext_string(mpack_reader_t* reader, mpack_tag_t tag, ExceptionSink* xsink);
+DLLLOCAL AbstractQoreNode* msgpack_unpack_ext_typed_array(mpack_reader_t* reader, mpack_tag_t tag, ExceptionSink* xsink);
+
+//! Read the array type of a typed array extension and get the number of its elements; returns false on error.
+DLLLOCAL bool msgpack_unpack_typed_array_header(mpack_reader_t* reader, mpack_tag_t tag, TypedArrayExtensionType& type, size_t& count);
+//! Read the elements of a typed array extension after msgpack_unpack_typed_array_header().
+DLLLOCAL AbstractQoreNode* msgpack_unpack_typed_array_elements(mpack_reader_t* reader, TypedArrayExtensionType type, size_t count, ExceptionSink* xsink);
 
 } // namespace intern
 } // namespace msgpack
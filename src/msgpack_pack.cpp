@@ -30,7 +30,9 @@
 // std
 #include <cstddef>
 #include <cstdint>
-#include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <string>
 
 // qore
 #include "qore/qore_bitopts.h"
@@ -39,6 +41,8 @@
 #include "msgpack_enums.h"
 #include "msgpack_extensions.h"
 #include "MsgPackException.h"
+#include "msgpack_unpack.h"
+#include "MsgPackWorkStack.h"
 #include "QC_MsgPackExtension.h"
 
 namespace msgpack {
@@ -48,6 +52,9 @@ namespace intern {
 // Qore nodes/values writing functions
 //-------------------------------------
 
+// The functions depending on the operation mode are templates specialized for
+// each mode; the runtime mode is only dispatched on when entering the engines.
+
 void msgpack_pack_qore_binary(mpack_writer_t* writer, const BinaryNode* value) {
     msgpack_pack_binary(writer, static_cast<const char*>(value->getPtr()), value->size());
 }
@@ -56,146 +63,263 @@ void msgpack_pack_qore_bool(mpack_writer_t* writer, QoreValue value) {
     msgpack_pack_bool(writer, value.getAsBool());
 }
 
+template <OperationMode Mode>
+static void msgpack_pack_qore_date(mpack_writer_t* writer, const DateTimeNode* value) {
+    if (Mode == MSGPACK_QORE_MODE) {
+        msgpack_pack_ext_date(writer, value);
+    }
+    else if (value->isAbsolute()) {
+        msgpack_pack_ext_timestamp(writer, value);
+    }
+    else {
+        QoreString str;
+        value->format(str, "IF");
+        msgpack_pack_utf8(writer, str.c_str(), static_cast<uint32_t>(str.size()));
+    }
+}
+
 void msgpack_pack_qore_date(mpack_writer_t* writer, const DateTimeNode* value, OperationMode mode) {
     switch (mode) {
-        case MSGPACK_SIMPLE_MODE: {
-            if (value->isAbsolute()) {
-                msgpack_pack_ext_timestamp(writer, value);
-            }
-            else {
-                QoreString str;
-                value->format(str, "IF");
-                msgpack_pack_utf8(writer, str.c_str(), static_cast<uint32_t>(str.size()));
-            }
-            break;
-        }
+        case MSGPACK_SIMPLE_MODE:
+            msgpack_pack_qore_date<MSGPACK_SIMPLE_MODE>(writer, value); break;
         case MSGPACK_QORE_MODE:
-            msgpack_pack_ext_date(writer, value);
-            break;
+            msgpack_pack_qore_date<MSGPACK_QORE_MODE>(writer, value); break;
         default:
             break;
     }
 }
 
-void msgpack_pack_qore_float(mpack_writer_t* writer, QoreValue value) {
-    msgpack_pack_double(writer, value.getAsFloat());
+void msgpack_pack_qore_float(mpack_writer_t* writer, QoreValue value, bool compact) {
+    double d = value.getAsFloat();
+    if (compact && msgpack_float32_exact(d))
+        msgpack_pack_float32(writer, static_cast<float>(d));
+    else
+        msgpack_pack_double(writer, d);
 }
 
-void msgpack_pack_qore_hash(mpack_writer_t* writer, const QoreHashNode* value, OperationMode mode, ExceptionSink* xsink) {
-    qore_size_t size = value->size();
-
-    // start map writing
-    mpack_start_map(writer, static_cast<uint32_t>(size));
-
-    // write map elements
-    HashIterator it(const_cast<QoreHashNode*>(value));
-    while (it.next()) {
-        // write key
-        std::unique_ptr<QoreString> key(it.getKeyString());
-        msgpack_pack_qore_string(writer, key.get(), mode, xsink);
-
-        // write value
-        msgpack_pack_qore_value(writer, it.get(), mode, xsink);
+template <OperationMode Mode>
+static void msgpack_pack_qore_string(mpack_writer_t* writer, const QoreString* value, ExceptionSink* xsink) {
+    if (value->getEncoding() == QCS_UTF8) {
+        msgpack_pack_utf8(writer, value->c_str(), value->size());
+    }
+    else if (Mode == MSGPACK_QORE_MODE) {
+        msgpack_pack_ext_string(writer, value);
+    }
+    else {
+        TempEncodingHelper temp(value, QCS_UTF8, xsink);
+        if (xsink && *xsink)
+            mpack_writer_flag_error(writer, mpack_error_data);
+        if (*temp)
+            msgpack_pack_utf8(writer, temp->c_str(), temp->size());
     }
-
-    // finish map writing
-    mpack_finish_map(writer);
 }
 
-void msgpack_pack_qore_int(mpack_writer_t* writer, QoreValue value) {
-    msgpack_pack_int(writer, value.getAsBigInt());
+void msgpack_pack_qore_string(mpack_writer_t* writer, const QoreString* value, OperationMode mode, ExceptionSink* xsink) {
+    switch (mode) {
+        case MSGPACK_SIMPLE_MODE:
+            msgpack_pack_qore_string<MSGPACK_SIMPLE_MODE>(writer, value, xsink); break;
+        case MSGPACK_QORE_MODE:
+            msgpack_pack_qore_string<MSGPACK_QORE_MODE>(writer, value, xsink); break;
+        default:
+            break;
+    }
 }
 
-void msgpack_pack_qore_list(mpack_writer_t* writer, QoreValue value, OperationMode mode, ExceptionSink* xsink) {
-    QoreListNode* listNode = value.get<QoreListNode>();
-    size_t size = listNode->size();
+template <OperationMode Mode>
+static void msgpack_pack_qore_hash_key(mpack_writer_t* writer, const std::string& key, PackContext& ctx, ExceptionSink* xsink) {
+    // keys are stored in the default encoding; convert them like any other string if it is not UTF-8
+    if (QCS_DEFAULT != QCS_UTF8) {
+        QoreString str(key.data(), key.size(), QCS_DEFAULT);
+        msgpack_pack_qore_string<Mode>(writer, &str, xsink);
+        return;
+    }
+
+    if (ctx.keyCache) {
+        const std::string* encoded = ctx.keyCache->find(key.data(), key.size());
+        if (!encoded && key.size() <= MsgPackKeyCache::MaxKeySize && msgpack_utf8_check(key.data(), key.size())) {
+            char header[MPACK_TAG_SIZE_STR32];
+            size_t headerSize = msgpack_encode_str_header(header, static_cast<uint32_t>(key.size()));
+            encoded = ctx.keyCache->insert(key.data(), key.size(), header, headerSize);
+        }
+        // write the header and the key bytes with a single copy
+        if (encoded) {
+            mpack_write_object_bytes(writer, encoded->data(), encoded->size());
+            return;
+        }
+    }
 
-    // start array writing
-    mpack_start_array(writer, static_cast<uint32_t>(size));
+    msgpack_pack_utf8(writer, key.data(), static_cast<uint32_t>(key.size()));
+}
 
-    // write array elements
-    for (size_t i = 0; i < size; i++) {
-        msgpack_pack_qore_value(writer, listNode->retrieveEntry(i), mode, xsink);
+void msgpack_pack_qore_hash_key(mpack_writer_t* writer, const std::string& key, PackContext& ctx, ExceptionSink* xsink) {
+    switch (ctx.mode) {
+        case MSGPACK_SIMPLE_MODE:
+            msgpack_pack_qore_hash_key<MSGPACK_SIMPLE_MODE>(writer, key, ctx, xsink); break;
+        case MSGPACK_QORE_MODE:
+            msgpack_pack_qore_hash_key<MSGPACK_QORE_MODE>(writer, key, ctx, xsink); break;
+        default:
+            break;
     }
+}
 
-    // finish array writing
-    mpack_finish_array(writer);
+void msgpack_pack_qore_int(mpack_writer_t* writer, QoreValue value) {
+    msgpack_pack_int(writer, value.getAsBigInt());
 }
 
 void msgpack_pack_qore_nothing(mpack_writer_t* writer) {
     msgpack_pack_nil(writer);
 }
 
+template <OperationMode Mode>
+static void msgpack_pack_qore_null(mpack_writer_t* writer) {
+    if (Mode == MSGPACK_QORE_MODE)
+        msgpack_pack_ext_null(writer);
+    else
+        msgpack_pack_nil(writer);
+}
+
 void msgpack_pack_qore_null(mpack_writer_t* writer, OperationMode mode) {
     switch (mode) {
         case MSGPACK_SIMPLE_MODE:
-            msgpack_pack_nil(writer); break;
+            msgpack_pack_qore_null<MSGPACK_SIMPLE_MODE>(writer); break;
         case MSGPACK_QORE_MODE:
-            msgpack_pack_ext_null(writer); break;
+            msgpack_pack_qore_null<MSGPACK_QORE_MODE>(writer); break;
         default:
             break;
     }
 }
 
+template <OperationMode Mode>
+static void msgpack_pack_qore_number(mpack_writer_t* writer, const QoreNumberNode* value, bool decimal = false, MsgPackNumberEncodings* encodings = nullptr) {
+    if (Mode == MSGPACK_QORE_MODE)
+        msgpack_pack_ext_number(writer, value, decimal, encodings);
+    else
+        msgpack_pack_double(writer, value->getAsFloat());
+}
+
 void msgpack_pack_qore_number(mpack_writer_t* writer, const QoreNumberNode* value, OperationMode mode) {
     switch (mode) {
-        case MSGPACK_SIMPLE_MODE: {
-            msgpack_pack_double(writer, value->getAsFloat());
-            break;
-        }
+        case MSGPACK_SIMPLE_MODE:
+            msgpack_pack_qore_number<MSGPACK_SIMPLE_MODE>(writer, value); break;
         case MSGPACK_QORE_MODE:
-            msgpack_pack_ext_number(writer, value);
-            break;
+            msgpack_pack_qore_number<MSGPACK_QORE_MODE>(writer, value); break;
         default:
             break;
     }
 }
 
-void msgpack_pack_qore_string(mpack_writer_t* writer, const QoreString* value, OperationMode mode, ExceptionSink* xsink) {
-    if (value->getEncoding() == QCS_UTF8) {
-        msgpack_pack_utf8(writer, value->c_str(), value->size());
+
+//-------------------------------------
+// Iterative pack engine
+//-------------------------------------
+
+namespace {
+
+// A list or hash whose elements are being written or sized; hashes are iterated
+// by the iterator on top of the separate hash iterator stack.
+struct PackFrame {
+    //! The list or null for a hash.
+    const QoreListNode* list;
+    //! Index of the next list element.
+    size_t index = 0;
+
+    DLLLOCAL PackFrame(const QoreListNode* l) : list(l) {}
+};
+
+typedef MsgPackWorkStack<PackFrame> PackFrameStack;
+typedef MsgPackWorkStack<ConstHashIterator> PackHashStack;
+
+void msgpack_check_pack_depth(const PackFrameStack& frames, const PackContext& ctx) {
+    if (frames.size() >= ctx.maxDepth)
+        throw msgpack::MsgPackExceptionMaker("nesting depth exceeds the limit of %zu", ctx.maxDepth);
+}
+
+// Writes a list that needs no per-element type dispatch; returns false if the elements have to be written one by one.
+template <OperationMode Mode>
+bool msgpack_pack_qore_list_direct(mpack_writer_t* writer, const QoreListNode* list, PackContext& ctx, ExceptionSink* xsink) {
+    // lists of ints and floats are written as typed arrays in Qore mode
+    TypedArrayExtensionType arrayType;
+    if (Mode == MSGPACK_QORE_MODE && ctx.typedArrays && msgpack_typed_array_type(list, arrayType, ctx.compactFloats)) {
+        msgpack_pack_ext_typed_array(writer, list, arrayType);
+        return true;
     }
-    else {
-        switch (mode) {
-            case MSGPACK_SIMPLE_MODE: {
-                TempEncodingHelper temp(value, QCS_UTF8, xsink);
-                if (xsink && *xsink)
-                    mpack_writer_flag_error(writer, mpack_error_data);
-                if (*temp)
-                    msgpack_pack_utf8(writer, temp->c_str(), temp->size());
-                break;
-            }
-            case MSGPACK_QORE_MODE:
-                msgpack_pack_ext_string(writer, value);
-                break;
-            default:
-                break;
+
+    size_t size = list->size();
+    const QoreTypeInfo* elementType = list->getValueTypeInfo();
+    if (elementType == bigIntTypeInfo) {
+        mpack_start_array(writer, static_cast<uint32_t>(size));
+        for (size_t i = 0; i < size; i++)
+            msgpack_pack_int(writer, list->retrieveEntry(i).getAsBigInt());
+    }
+    else if (elementType == floatTypeInfo) {
+        mpack_start_array(writer, static_cast<uint32_t>(size));
+        // lists whose elements all convert without loss are written as float32 without checking each element
+        bool float32 = false;
+        if (ctx.compactFloats && !(ctx.floatLists && ctx.floatLists->next(list, float32)))
+            float32 = msgpack_float32_list(list);
+        if (float32) {
+            for (size_t i = 0; i < size; i++)
+                msgpack_pack_float32(writer, static_cast<float>(list->retrieveEntry(i).getAsFloat()));
+        }
+        else {
+            for (size_t i = 0; i < size; i++)
+                msgpack_pack_qore_float(writer, list->retrieveEntry(i), ctx.compactFloats);
         }
     }
+    else if (elementType == boolTypeInfo) {
+        mpack_start_array(writer, static_cast<uint32_t>(size));
+        for (size_t i = 0; i < size; i++)
+            msgpack_pack_bool(writer, list->retrieveEntry(i).getAsBool());
+    }
+    else if (elementType == stringTypeInfo) {
+        mpack_start_array(writer, static_cast<uint32_t>(size));
+        for (size_t i = 0; i < size; i++)
+            msgpack_pack_qore_string<Mode>(writer, list->retrieveEntry(i).get<const QoreStringNode>(), xsink);
+    }
+    else {
+        return false;
+    }
+    mpack_finish_array(writer);
+    return true;
 }
 
-void msgpack_pack_qore_value(mpack_writer_t* writer, QoreValue value, OperationMode mode, ExceptionSink* xsink) {
+// Writes a value; the elements of lists and hashes are left to the engine loop by pushing them on the work stack.
+template <OperationMode Mode>
+void msgpack_pack_qore_item(mpack_writer_t* writer, QoreValue value, PackContext& ctx, PackFrameStack& frames, PackHashStack& hashes, ExceptionSink* xsink) {
     switch (value.getType()) {
         case NT_BINARY:                     // BinaryNode
             msgpack_pack_qore_binary(writer, value.get<const BinaryNode>()); break;
         case NT_BOOLEAN:                    // bool
             msgpack_pack_qore_bool(writer, value); break;
         case NT_DATE:                       // DateTimeNode
-            msgpack_pack_qore_date(writer, value.get<const DateTimeNode>(), mode); break;
+            msgpack_pack_qore_date<Mode>(writer, value.get<const DateTimeNode>()); break;
         case NT_FLOAT:                      // double
-            msgpack_pack_qore_float(writer, value); break;
-        case NT_HASH:                       // QoreHashNode
-            msgpack_pack_qore_hash(writer, value.get<const QoreHashNode>(), mode, xsink); break;
+            msgpack_pack_qore_float(writer, value, ctx.compactFloats); break;
+        case NT_HASH: {                     // QoreHashNode
+            const QoreHashNode* hash = value.get<const QoreHashNode>();
+            msgpack_check_pack_depth(frames, ctx);
+            mpack_start_map(writer, static_cast<uint32_t>(hash->size()));
+            frames.push(nullptr);
+            hashes.push(hash);
+            break;
+        }
         case NT_INT:                        // int64 (long long)
             msgpack_pack_qore_int(writer, value); break;
-        case NT_LIST:                       // QoreListNode
-            msgpack_pack_qore_list(writer, value, mode, xsink); break;
+        case NT_LIST: {                     // QoreListNode
+            const QoreListNode* list = value.get<const QoreListNode>();
+            msgpack_check_pack_depth(frames, ctx);
+            if (msgpack_pack_qore_list_direct<Mode>(writer, list, ctx, xsink))
+                break;
+            mpack_start_array(writer, static_cast<uint32_t>(list->size()));
+            frames.push(list);
+            break;
+        }
         case NT_NOTHING:                    // QoreNothingNode
             msgpack_pack_qore_nothing(writer); break;
         case NT_NULL:                       // QoreNullNode
-            msgpack_pack_qore_null(writer, mode); break;
+            msgpack_pack_qore_null<Mode>(writer); break;
         case NT_NUMBER:                     // QoreNumberNode
-            msgpack_pack_qore_number(writer, value.get<const QoreNumberNode>(), mode); break;
+            msgpack_pack_qore_number<Mode>(writer, value.get<const QoreNumberNode>(), ctx.decimalNumbers, ctx.numbers); break;
         case NT_OBJECT: {
             const QoreObject* obj = value.get<QoreObject>();
             if (obj->getClass(CID_MSGPACKEXTENSION)) {
@@ -208,32 +332,373 @@ void msgpack_pack_qore_value(mpack_writer_t* writer, QoreValue value, OperationM
             throw msgpack::MsgPackExceptionMaker("serializing objects is not supported (class: '%s')", obj->getClassName());
         }
         case NT_STRING:                     // QoreStringNode
-            msgpack_pack_qore_string(writer, value.get<const QoreStringNode>(), mode, xsink); break;
+            msgpack_pack_qore_string<Mode>(writer, value.get<const QoreStringNode>(), xsink); break;
         default: {
             throw msgpack::MsgPackExceptionMaker("serializing values of type '%s' is not supported", value.getTypeName());
         }
     }
 }
 
+template <OperationMode Mode>
+void msgpack_pack_qore_value(mpack_writer_t* writer, QoreValue value, PackContext& ctx, ExceptionSink* xsink) {
+    PackFrameStack frames;
+    PackHashStack hashes;
+    msgpack_pack_qore_item<Mode>(writer, value, ctx, frames, hashes, xsink);
+
+    // write the elements of all started lists and hashes without recursion
+    while (!frames.empty()) {
+        PackFrame& frame = frames.top();
+        if (frame.list) {
+            if (frame.index < frame.list->size()) {
+                msgpack_pack_qore_item<Mode>(writer, frame.list->retrieveEntry(frame.index++), ctx, frames, hashes, xsink);
+                continue;
+            }
+            mpack_finish_array(writer);
+        }
+        else {
+            ConstHashIterator& it = hashes.top();
+            if (it.next()) {
+                msgpack_pack_qore_hash_key<Mode>(writer, it.getKeyStr(), ctx, xsink);
+                msgpack_pack_qore_item<Mode>(writer, it.get(), ctx, frames, hashes, xsink);
+                continue;
+            }
+            mpack_finish_map(writer);
+            hashes.pop();
+        }
+        frames.pop();
+    }
+}
+
+} // namespace
+
+void msgpack_pack_qore_value(mpack_writer_t* writer, QoreValue value, PackContext& ctx, ExceptionSink* xsink) {
+    switch (ctx.mode) {
+        case MSGPACK_SIMPLE_MODE:
+            msgpack_pack_qore_value<MSGPACK_SIMPLE_MODE>(writer, value, ctx, xsink); break;
+        case MSGPACK_QORE_MODE:
+            msgpack_pack_qore_value<MSGPACK_QORE_MODE>(writer, value, ctx, xsink); break;
+        default:
+            break;
+    }
+}
+
+
+//-------------------------------------
+// Qore nodes/values sizing functions
+//-------------------------------------
+
+static size_t msgpack_size_qore_float(QoreValue value, bool compact) {
+    return (compact && msgpack_float32_exact(value.getAsFloat())) ? MPACK_TAG_SIZE_FLOAT : MPACK_TAG_SIZE_DOUBLE;
+}
+
+template <OperationMode Mode>
+static size_t msgpack_size_qore_date(const DateTimeNode* value) {
+    if (Mode == MSGPACK_QORE_MODE)
+        return msgpack_size_ext_date(value);
+    if (value->isAbsolute())
+        return msgpack_size_ext_timestamp(value);
+    QoreString str;
+    value->format(str, "IF");
+    return msgpack_size_utf8(static_cast<uint32_t>(str.size()));
+}
+
+template <OperationMode Mode>
+static size_t msgpack_size_qore_string(const QoreString* value, ExceptionSink* xsink) {
+    if (value->getEncoding() == QCS_UTF8)
+        return msgpack_size_utf8(value->size());
+    if (Mode == MSGPACK_QORE_MODE)
+        return msgpack_size_ext_string(value);
+    TempEncodingHelper temp(value, QCS_UTF8, xsink);
+    return *temp ? msgpack_size_utf8(temp->size()) : 0;
+}
+
+namespace {
+
+// Sizes a list that needs no per-element type dispatch; returns false if the elements have to be sized one by one.
+template <OperationMode Mode>
+bool msgpack_size_qore_list_direct(const QoreListNode* value, const PackContext& ctx, size_t& size, ExceptionSink* xsink) {
+    TypedArrayExtensionType arrayType;
+    if (Mode == MSGPACK_QORE_MODE && ctx.typedArrays && msgpack_typed_array_type(value, arrayType, ctx.compactFloats)) {
+        size = msgpack_size_ext_typed_array(value, arrayType);
+        return true;
+    }
+
+    size_t count = value->size();
+    size = msgpack_size_array(static_cast<uint32_t>(count));
+
+    const QoreTypeInfo* elementType = value->getValueTypeInfo();
+    if (elementType == floatTypeInfo) {
+        if (!ctx.compactFloats) {
+            size += count * MPACK_TAG_SIZE_DOUBLE;
+            return true;
+        }
+        // the result is recorded for the pack pass
+        bool float32 = msgpack_float32_list(value);
+        if (ctx.floatLists)
+            ctx.floatLists->add(value, float32);
+        if (float32) {
+            size += count * MPACK_TAG_SIZE_FLOAT;
+            return true;
+        }
+        for (size_t i = 0; i < count; i++)
+            size += msgpack_size_qore_float(value->retrieveEntry(i), true);
+        return true;
+    }
+    if (elementType == boolTypeInfo) {
+        size += count;
+        return true;
+    }
+    if (elementType == bigIntTypeInfo) {
+        for (size_t i = 0; i < count; i++)
+            size += msgpack_size_int(value->retrieveEntry(i).getAsBigInt());
+        return true;
+    }
+    if (elementType == stringTypeInfo) {
+        for (size_t i = 0; i < count; i++)
+            size += msgpack_size_qore_string<Mode>(value->retrieveEntry(i).get<const QoreStringNode>(), xsink);
+        return true;
+    }
+    return false;
+}
+
+// Returns the size of a value; for lists and hashes only the header is sized and the elements are left to the engine loop.
+template <OperationMode Mode>
+size_t msgpack_size_qore_item(QoreValue value, const PackContext& ctx, PackFrameStack& frames, PackHashStack& hashes, ExceptionSink* xsink) {
+    switch (value.getType()) {
+        case NT_BINARY:
+            return msgpack_size_binary(value.get<const BinaryNode>()->size());
+        case NT_BOOLEAN:
+            return 1;
+        case NT_DATE:
+            return msgpack_size_qore_date<Mode>(value.get<const DateTimeNode>());
+        case NT_FLOAT:
+            return msgpack_size_qore_float(value, ctx.compactFloats);
+        case NT_HASH: {
+            const QoreHashNode* hash = value.get<const QoreHashNode>();
+            msgpack_check_pack_depth(frames, ctx);
+            frames.push(nullptr);
+            hashes.push(hash);
+            return msgpack_size_map(static_cast<uint32_t>(hash->size()));
+        }
+        case NT_INT:
+            return msgpack_size_int(value.getAsBigInt());
+        case NT_LIST: {
+            const QoreListNode* list = value.get<const QoreListNode>();
+            msgpack_check_pack_depth(frames, ctx);
+            size_t size;
+            if (msgpack_size_qore_list_direct<Mode>(list, ctx, size, xsink))
+                return size;
+            frames.push(list);
+            return size;
+        }
+        case NT_NOTHING:
+            return 1;
+        case NT_NULL:
+            return (Mode == MSGPACK_QORE_MODE) ? msgpack_size_ext_null() : 1;
+        case NT_NUMBER:
+            if (Mode == MSGPACK_QORE_MODE)
+                return msgpack_size_ext_number(value.get<const QoreNumberNode>(), ctx.decimalNumbers, ctx.numbers);
+            return MPACK_TAG_SIZE_DOUBLE;
+        case NT_OBJECT: {
+            const QoreObject* obj = value.get<QoreObject>();
+            if (obj->getClass(CID_MSGPACKEXTENSION)) {
+                PrivateDataRefHolder<MsgPackExtension> holder(obj, CID_MSGPACKEXTENSION, xsink);
+                MsgPackExtension* ext = *holder;
+                return ext ? msgpack_size_ext_ext(ext) : 0;
+            }
+            throw msgpack::MsgPackExceptionMaker("serializing objects is not supported (class: '%s')", obj->getClassName());
+        }
+        case NT_STRING:
+            return msgpack_size_qore_string<Mode>(value.get<const QoreStringNode>(), xsink);
+        default: {
+            throw msgpack::MsgPackExceptionMaker("serializing values of type '%s' is not supported", value.getTypeName());
+        }
+    }
+}
+
+template <OperationMode Mode>
+size_t msgpack_size_qore_value(QoreValue value, const PackContext& ctx, ExceptionSink* xsink) {
+    PackFrameStack frames;
+    PackHashStack hashes;
+    size_t size = msgpack_size_qore_item<Mode>(value, ctx, frames, hashes, xsink);
+
+    // size the elements of all lists and hashes without recursion
+    while (!frames.empty()) {
+        PackFrame& frame = frames.top();
+        if (frame.list) {
+            if (frame.index < frame.list->size()) {
+                size += msgpack_size_qore_item<Mode>(frame.list->retrieveEntry(frame.index++), ctx, frames, hashes, xsink);
+                continue;
+            }
+        }
+        else {
+            ConstHashIterator& it = hashes.top();
+            if (it.next()) {
+                const std::string& key = it.getKeyStr();
+                if (QCS_DEFAULT == QCS_UTF8) {
+                    size += msgpack_size_utf8(static_cast<uint32_t>(key.size()));
+                }
+                else {
+                    QoreString str(key.data(), key.size(), QCS_DEFAULT);
+                    size += msgpack_size_qore_string<Mode>(&str, xsink);
+                }
+                size += msgpack_size_qore_item<Mode>(it.get(), ctx, frames, hashes, xsink);
+                continue;
+            }
+            hashes.pop();
+        }
+        frames.pop();
+    }
+    return size;
+}
+
+} // namespace
+
+size_t msgpack_size_qore_value(QoreValue value, const PackContext& ctx, ExceptionSink* xsink) {
+    switch (ctx.mode) {
+        case MSGPACK_SIMPLE_MODE:
+            return msgpack_size_qore_value<MSGPACK_SIMPLE_MODE>(value, ctx, xsink);
+        case MSGPACK_QORE_MODE:
+            return msgpack_size_qore_value<MSGPACK_QORE_MODE>(value, ctx, xsink);
+        default:
+            break;
+    }
+    return 0;
+}
+
+
+//----------------------------
+// Scratch buffer flush target
+//----------------------------
+
+// Intrusive flush function growing the MsgPackBuffer in the writer's context
+// instead of emptying it (the same approach as mpack's growable writer).
+static void msgpack_scratch_writer_flush(mpack_writer_t* writer, const char* data, size_t count) {
+    MsgPackBuffer* scratch = static_cast<MsgPackBuffer*>(mpack_writer_context(writer));
+
+    if (data == writer->buffer) {
+        // teardown, nothing to do; the data stays in the buffer
+        if (mpack_writer_buffer_used(writer) == count)
+            return;
+
+        // otherwise leave the data in the buffer and just grow
+        writer->current = writer->buffer + count;
+        count = 0;
+    }
+
+    size_t used = mpack_writer_buffer_used(writer);
+    if (!scratch->grow(used + count)) {
+        mpack_writer_flag_error(writer, mpack_error_memory);
+        return;
+    }
+    writer->buffer = scratch->getBuffer();
+    writer->current = writer->buffer + used;
+    writer->end = writer->buffer + scratch->getCapacity();
+
+    // append the extra data
+    if (count) {
+        memcpy(writer->current, data, count);
+        writer->current += count;
+    }
+}
+
+
+//----------------------------
+// Output stream flush target
+//----------------------------
+
+// context of the output stream writer
+struct StreamWriterContext {
+    OutputStream* os;
+    ExceptionSink* xsink;
+};
+
+static void msgpack_stream_writer_flush(mpack_writer_t* writer, const char* data, size_t count) {
+    StreamWriterContext* ctx = static_cast<StreamWriterContext*>(mpack_writer_context(writer));
+    ctx->os->write(data, static_cast<int64>(count), ctx->xsink);
+    if (*ctx->xsink)
+        mpack_writer_flag_error(writer, mpack_error_io);
+}
+
 
 //-----------------------
 // msgpack_pack function
 //-----------------------
 
-QoreValue msgpack_pack(QoreValue& data, OperationMode mode, ExceptionSink* xsink) {
-    size_t size = 0;
-    char* buffer = nullptr;
-    mpack_writer_t writer;
+// Shares the number encodings and the float list compaction between the sizing and the pack pass of a call.
+class PackEncodingsScope {
+public:
+    DLLLOCAL PackEncodingsScope(PackContext& c) : ctx(c) {
+        ctx.numbers = &numbers;
+        ctx.floatLists = &floatLists;
+    }
+
+    DLLLOCAL ~PackEncodingsScope() {
+        ctx.numbers = nullptr;
+        ctx.floatLists = nullptr;
+    }
+
+private:
+    PackContext& ctx;
+    MsgPackNumberEncodings numbers;
+    MsgPackFloatListEncodings floatLists;
+};
+
+// Computes the exact encoded size of the data, turning sizing errors into an exception; all errors of the
+// data (including the nesting depth limit) are raised here, before the buffer is allocated.
+// Values whose encoded form has to be created first (non-UTF-8 strings and hash keys in simple mode,
+// relative dates in simple mode and numbers not using the decimal subtype in Qore mode) are converted
+// again by the pack pass; only the decimal number and float list checks are shared (see PackEncodingsScope).
+static size_t msgpack_pack_size(QoreValue& data, PackContext& ctx, ExceptionSink* xsink) {
+    size_t size = msgpack_size_qore_value(data, ctx, xsink);
+    if (xsink && *xsink)
+        throw msgpack::getMsgPackException(mpack_error_data);
+    return size;
+}
 
+// Packs the data into a buffer of exactly the size computed by msgpack_pack_size().
+static mpack_error_t msgpack_pack_exact(char* buffer, size_t size, QoreValue& data, PackContext& ctx, ExceptionSink* xsink) {
     // initialize writer
-    mpack_writer_init_growable(&writer, &buffer, &size);
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buffer, size);
 
-    // pack the data
-    msgpack_pack_qore_value(&writer, data, mode, xsink);
+    // pack the data; the writer is destroyed before an exception leaves, so that the caller can release the buffer
+    try {
+        msgpack_pack_qore_value(&writer, data, ctx, xsink);
+    }
+    catch (...) {
+        mpack_writer_flag_error(&writer, mpack_error_bug);
+        mpack_writer_destroy(&writer);
+        throw;
+    }
+    if (mpack_writer_buffer_used(&writer) != size)
+        mpack_writer_flag_error(&writer, mpack_error_bug);
 
     // finish writing
-    mpack_error_t result = mpack_writer_destroy(&writer);
+    return mpack_writer_destroy(&writer);
+}
+
+QoreValue msgpack_pack(QoreValue& data, PackContext& ctx, ExceptionSink* xsink) {
+    // compute the exact encoded size first, so that the data can be written
+    // into a single allocation that is handed over to the resulting BinaryNode
+    PackEncodingsScope encodings(ctx);
+    size_t size = msgpack_pack_size(data, ctx, xsink);
+
+    // mpack does not accept a null buffer, even for empty data
+    char* buffer = static_cast<char*>(malloc(size ? size : 1));
+    if (!buffer)
+        throw msgpack::getMsgPackException(mpack_error_memory);
+
+    mpack_error_t result;
+    try {
+        result = msgpack_pack_exact(buffer, size, data, ctx, xsink);
+    }
+    catch (...) {
+        free(buffer);
+        throw;
+    }
     if (result != mpack_ok) {
+        free(buffer);
         throw msgpack::getMsgPackException(result);
     }
 
@@ -242,5 +707,128 @@ QoreValue msgpack_pack(QoreValue& data, OperationMode mode, ExceptionSink* xsink
     return bin;
 }
 
+// Restores the original size of a binary that packed data was appended to.
+static void msgpack_pack_into_rollback(BinaryNode* dest, size_t offset) {
+    if (offset)
+        dest->preallocate(offset);
+    else
+        dest->clear();
+}
+
+size_t msgpack_pack_into(BinaryNode* dest, QoreValue& data, PackContext& ctx, ExceptionSink* xsink) {
+    PackEncodingsScope encodings(ctx);
+    size_t size = msgpack_pack_size(data, ctx, xsink);
+
+    // extend the destination once and write directly behind the existing data
+    size_t offset = dest->size();
+    if (dest->preallocate(offset + size))
+        throw msgpack::getMsgPackException(mpack_error_memory);
+    char* buffer = static_cast<char*>(const_cast<void*>(dest->getPtr())) + offset;
+
+    // drop the partially written data on errors
+    mpack_error_t result;
+    try {
+        result = msgpack_pack_exact(buffer, size, data, ctx, xsink);
+    }
+    catch (...) {
+        msgpack_pack_into_rollback(dest, offset);
+        throw;
+    }
+    if (result != mpack_ok) {
+        msgpack_pack_into_rollback(dest, offset);
+        throw msgpack::getMsgPackException(result);
+    }
+
+    return size;
+}
+
+size_t msgpack_pack_into(const ReferenceNode* ref, QoreValue& data, PackContext& ctx, ExceptionSink* xsink) {
+    QoreTypeSafeReferenceHelper helper(ref, xsink);
+    if (!helper)
+        return 0;
+
+    switch (helper.getType()) {
+        case NT_NOTHING:
+            // start a new binary
+            if (helper.assign(new BinaryNode))
+                return 0;
+            break;
+        case NT_BINARY:
+            break;
+        default:
+            throw msgpack::MsgPackExceptionMaker("cannot append packed data to a reference to type '%s'; expecting 'binary'", helper.getTypeName());
+    }
+
+    // make sure the binary is not shared before modifying it in place
+    BinaryNode* dest = static_cast<BinaryNode*>(helper.getUnique(xsink));
+    if (!dest)
+        return 0;
+    return msgpack_pack_into(dest, data, ctx, xsink);
+}
+
+void msgpack_scratch_writer_init(mpack_writer_t* writer, MsgPackBuffer& scratch) {
+    if (!scratch.prepare())
+        throw msgpack::getMsgPackException(mpack_error_memory);
+
+    // initialize writer on the scratch buffer
+    mpack_writer_init(writer, scratch.getBuffer(), scratch.getCapacity());
+    mpack_writer_set_context(writer, &scratch);
+    mpack_writer_set_flush(writer, msgpack_scratch_writer_flush);
+}
+
+QoreValue msgpack_scratch_writer_finish(mpack_writer_t* writer, MsgPackBuffer& scratch) {
+    size_t size = mpack_writer_buffer_used(writer);
+
+    // finish writing
+    mpack_error_t result = mpack_writer_destroy(writer);
+    if (result != mpack_ok) {
+        throw msgpack::getMsgPackException(result);
+    }
+
+    // copy the data into an exactly sized buffer for the binary node
+    char* buffer = static_cast<char*>(malloc(size ? size : 1));
+    if (!buffer)
+        throw msgpack::getMsgPackException(mpack_error_memory);
+    memcpy(buffer, scratch.getBuffer(), size);
+    scratch.update(size);
+
+    // return a binary node
+    QoreValue bin(new BinaryNode(buffer, size));
+    return bin;
+}
+
+QoreValue msgpack_pack(QoreValue& data, PackContext& ctx, MsgPackBuffer& scratch, ExceptionSink* xsink) {
+    mpack_writer_t writer;
+    msgpack_scratch_writer_init(&writer, scratch);
+
+    // pack the data
+    msgpack_pack_qore_value(&writer, data, ctx, xsink);
+
+    return msgpack_scratch_writer_finish(&writer, scratch);
+}
+
+void msgpack_pack_to_stream(OutputStream* os, QoreValue& data, PackContext& ctx, ExceptionSink* xsink) {
+    char buffer[MPACK_BUFFER_SIZE];
+    StreamWriterContext streamCtx = {os, xsink};
+
+    // initialize writer flushing into the stream whenever the buffer is full
+    mpack_writer_t writer;
+    mpack_writer_init(&writer, buffer, sizeof(buffer));
+    mpack_writer_set_context(&writer, &streamCtx);
+    mpack_writer_set_flush(&writer, msgpack_stream_writer_flush);
+
+    // pack the data
+    msgpack_pack_qore_value(&writer, data, ctx, xsink);
+
+    // finish writing; this flushes the rest of the buffer
+    mpack_error_t result = mpack_writer_destroy(&writer);
+    if (result != mpack_ok) {
+        // stream errors have already been raised by the stream
+        if (result == mpack_error_io && *xsink)
+            return;
+        throw msgpack::getMsgPackException(result);
+    }
+}
+
 } // namespace intern
 } // namespace msgpack
@@ -28,14 +28,22 @@
 #ifndef _QORE_MODULE_MSGPACK_MSGPACK_PACK_H
 #define _QORE_MODULE_MSGPACK_MSGPACK_PACK_H
 
+// std
+#include <cfloat>
+#include <cmath>
+#include <string>
+
 // qore
 #include "qore/Qore.h"
+#include "qore/OutputStream.h"
 
 // mpack library
 #include "mpack/mpack.h"
 
 // module sources
 #include "msgpack_enums.h"
+#include "MsgPackBuffer.h"
+#include "MsgPackKeyCache.h"
 
 namespace msgpack {
 namespace intern {
@@ -61,6 +69,17 @@ DLLLOCAL inline void msgpack_pack_double(mpack_writer_t* writer, double value) {
     mpack_write_double(writer, value);
 }
 
+DLLLOCAL inline void msgpack_pack_float32(mpack_writer_t* writer, float value) {
+    mpack_write_float(writer, value);
+}
+
+//! Check whether the value is unchanged when converted to float32 and back (NaNs are not, to keep their payload).
+DLLLOCAL inline bool msgpack_float32_exact(double value) {
+    // converting finite values out of the float range is undefined
+    return (std::fabs(value) <= FLT_MAX || std::isinf(value))
+        && static_cast<double>(static_cast<float>(value)) == value;
+}
+
 DLLLOCAL inline void msgpack_pack_int(mpack_writer_t* writer, int64 value) {
     mpack_write_i64(writer, value);
 }
@@ -79,30 +98,202 @@ DLLLOCAL inline void msgpack_pack_utf8(mpack_writer_t* writer, const char* value
 }
 
 
+//-----------------------------
+// Raw value sizing functions
+//-----------------------------
+
+// these mirror the encodings chosen by the mpack writer functions above
+
+DLLLOCAL inline size_t msgpack_size_array(uint32_t count) {
+    if (count <= 15)
+        return MPACK_TAG_SIZE_FIXARRAY;
+    if (count <= UINT16_MAX)
+        return MPACK_TAG_SIZE_ARRAY16;
+    return MPACK_TAG_SIZE_ARRAY32;
+}
+
+DLLLOCAL inline size_t msgpack_size_binary(uint32_t size) {
+    if (size <= UINT8_MAX)
+        return MPACK_TAG_SIZE_BIN8 + size;
+    if (size <= UINT16_MAX)
+        return MPACK_TAG_SIZE_BIN16 + size;
+    return MPACK_TAG_SIZE_BIN32 + size;
+}
+
+DLLLOCAL inline size_t msgpack_size_ext(uint32_t size) {
+    switch (size) {
+        case 1: return MPACK_TAG_SIZE_FIXEXT1 + size;
+        case 2: return MPACK_TAG_SIZE_FIXEXT2 + size;
+        case 4: return MPACK_TAG_SIZE_FIXEXT4 + size;
+        case 8: return MPACK_TAG_SIZE_FIXEXT8 + size;
+        case 16: return MPACK_TAG_SIZE_FIXEXT16 + size;
+        default: break;
+    }
+    if (size <= UINT8_MAX)
+        return MPACK_TAG_SIZE_EXT8 + size;
+    if (size <= UINT16_MAX)
+        return MPACK_TAG_SIZE_EXT16 + size;
+    return MPACK_TAG_SIZE_EXT32 + size;
+}
+
+DLLLOCAL inline size_t msgpack_size_int(int64 value) {
+    if (value >= -32) {
+        if (value <= 127)
+            return MPACK_TAG_SIZE_FIXINT;
+        if (value <= UINT8_MAX)
+            return MPACK_TAG_SIZE_U8;
+        if (value <= UINT16_MAX)
+            return MPACK_TAG_SIZE_U16;
+        if (value <= UINT32_MAX)
+            return MPACK_TAG_SIZE_U32;
+        return MPACK_TAG_SIZE_U64;
+    }
+    if (value >= INT8_MIN)
+        return MPACK_TAG_SIZE_I8;
+    if (value >= INT16_MIN)
+        return MPACK_TAG_SIZE_I16;
+    if (value >= INT32_MIN)
+        return MPACK_TAG_SIZE_I32;
+    return MPACK_TAG_SIZE_I64;
+}
+
+DLLLOCAL inline size_t msgpack_size_map(uint32_t count) {
+    if (count <= 15)
+        return MPACK_TAG_SIZE_FIXMAP;
+    if (count <= UINT16_MAX)
+        return MPACK_TAG_SIZE_MAP16;
+    return MPACK_TAG_SIZE_MAP32;
+}
+
+DLLLOCAL inline size_t msgpack_size_utf8(uint32_t size) {
+    if (size <= 31)
+        return MPACK_TAG_SIZE_FIXSTR + size;
+    if (size <= UINT8_MAX)
+        return MPACK_TAG_SIZE_STR8 + size;
+    if (size <= UINT16_MAX)
+        return MPACK_TAG_SIZE_STR16 + size;
+    return MPACK_TAG_SIZE_STR32 + size;
+}
+
+//! Encode the str header for a string of the passed size into \a buf (at least MPACK_TAG_SIZE_STR32 bytes); returns the header size.
+DLLLOCAL inline size_t msgpack_encode_str_header(char* buf, uint32_t size) {
+    if (size <= 31) {
+        buf[0] = static_cast<char>(0xa0 | size);
+        return MPACK_TAG_SIZE_FIXSTR;
+    }
+    if (size <= UINT8_MAX) {
+        buf[0] = static_cast<char>(0xd9);
+        buf[1] = static_cast<char>(size);
+        return MPACK_TAG_SIZE_STR8;
+    }
+    if (size <= UINT16_MAX) {
+        buf[0] = static_cast<char>(0xda);
+        mpack_store_u16(buf + 1, static_cast<uint16_t>(size));
+        return MPACK_TAG_SIZE_STR16;
+    }
+    buf[0] = static_cast<char>(0xdb);
+    mpack_store_u32(buf + 1, size);
+    return MPACK_TAG_SIZE_STR32;
+}
+
+
 //-------------------------------------
 // Qore nodes/values writing functions
 //-------------------------------------
 
+class MsgPackNumberEncodings;
+class MsgPackFloatListEncodings;
+
+//! State shared by the functions packing one value.
+struct PackContext {
+    OperationMode mode;
+    //! Optional cache of pre-encoded hash keys.
+    MsgPackKeyCache* keyCache = nullptr;
+    //! Maximum nesting depth of lists and hashes.
+    size_t maxDepth = SIZE_MAX;
+    //! Whether floats that convert to float32 without loss are written as float32.
+    bool compactFloats = false;
+    //! Whether int and float lists are written as typed arrays in Qore mode.
+    bool typedArrays = false;
+    //! Whether numbers are written with the decimal number subtype in Qore mode when possible.
+    bool decimalNumbers = false;
+    //! Optional decimal encodings of numbers recorded by the sizing pass for the pack pass.
+    MsgPackNumberEncodings* numbers = nullptr;
+    //! Optional float32 compaction of float lists recorded by the sizing pass for the pack pass.
+    MsgPackFloatListEncodings* floatLists = nullptr;
+
+    DLLLOCAL PackContext(OperationMode m, MsgPackKeyCache* kc = nullptr, size_t md = SIZE_MAX, bool cf = false, bool ta = false, bool dn = false)
+        : mode(m), keyCache(kc), maxDepth(md), compactFloats(cf), typedArrays(ta), decimalNumbers(dn) {}
+};
+
 DLLLOCAL void msgpack_pack_qore_binary(mpack_writer_t* writer, const BinaryNode* value);
 DLLLOCAL void msgpack_pack_qore_bool(mpack_writer_t* writer, QoreValue value);
 DLLLOCAL void msgpack_pack_qore_date(mpack_writer_t* writer, const DateTimeNode* value, OperationMode mode);
-DLLLOCAL void msgpack_pack_qore_float(mpack_writer_t* writer, QoreValue value);
-DLLLOCAL void msgpack_pack_qore_hash(mpack_writer_t* writer, const QoreHashNode* value, OperationMode mode, ExceptionSink* xsink);
+//! Write a float, as float32 if \a compact is set and the value converts without loss.
+DLLLOCAL void msgpack_pack_qore_float(mpack_writer_t* writer, QoreValue value, bool compact = false);
+//! Write a hash key directly from the key bytes of the hash, using the pre-encoded key cache if available.
+DLLLOCAL void msgpack_pack_qore_hash_key(mpack_writer_t* writer, const std::string& key, PackContext& ctx, ExceptionSink* xsink);
 DLLLOCAL void msgpack_pack_qore_int(mpack_writer_t* writer, QoreValue value);
-DLLLOCAL void msgpack_pack_qore_list(mpack_writer_t* writer, QoreValue value, OperationMode mode, ExceptionSink* xsink);
 DLLLOCAL void msgpack_pack_qore_nothing(mpack_writer_t* writer);
 DLLLOCAL void msgpack_pack_qore_null(mpack_writer_t* writer, OperationMode mode);
 DLLLOCAL void msgpack_pack_qore_number(mpack_writer_t* writer, const QoreNumberNode* value, OperationMode mode);
 DLLLOCAL void msgpack_pack_qore_string(mpack_writer_t* writer, const QoreString* value, OperationMode mode, ExceptionSink* xsink);
 
-DLLLOCAL void msgpack_pack_qore_value(mpack_writer_t* writer, QoreValue value, OperationMode mode, ExceptionSink* xsink);
+//! Write a value; nested lists and hashes are written iteratively using an explicit work stack.
+DLLLOCAL void msgpack_pack_qore_value(mpack_writer_t* writer, QoreValue value, PackContext& ctx, ExceptionSink* xsink);
+
+DLLLOCAL inline void msgpack_pack_qore_value(mpack_writer_t* writer, QoreValue value, OperationMode mode, ExceptionSink* xsink) {
+    PackContext ctx(mode);
+    msgpack_pack_qore_value(writer, value, ctx, xsink);
+}
+
+
+//-------------------------------------
+// Qore nodes/values sizing functions
+//-------------------------------------
+
+//! Returns the exact number of bytes that msgpack_pack_qore_value() will write for the passed value.
+DLLLOCAL size_t msgpack_size_qore_value(QoreValue value, const PackContext& ctx, ExceptionSink* xsink);
 
 
 //-----------------------
 // msgpack_pack function
 //-----------------------
 
-DLLLOCAL QoreValue msgpack_pack(QoreValue& data, OperationMode mode, ExceptionSink* xsink);
+DLLLOCAL QoreValue msgpack_pack(QoreValue& data, PackContext& ctx, ExceptionSink* xsink);
+
+DLLLOCAL inline QoreValue msgpack_pack(QoreValue& data, OperationMode mode, ExceptionSink* xsink) {
+    PackContext ctx(mode);
+    return msgpack_pack(data, ctx, xsink);
+}
+
+//! Initialize a writer growing the scratch buffer as needed.
+DLLLOCAL void msgpack_scratch_writer_init(mpack_writer_t* writer, MsgPackBuffer& scratch);
+
+//! Destroy a writer initialized by msgpack_scratch_writer_init() and return the written data as a new binary.
+DLLLOCAL QoreValue msgpack_scratch_writer_finish(mpack_writer_t* writer, MsgPackBuffer& scratch);
+
+//! Pack using a reusable scratch buffer; only the returned binary is allocated per call.
+DLLLOCAL QoreValue msgpack_pack(QoreValue& data, PackContext& ctx, MsgPackBuffer& scratch, ExceptionSink* xsink);
+
+//! Append the packed data to the end of an existing binary; returns the number of bytes appended.
+DLLLOCAL size_t msgpack_pack_into(BinaryNode* dest, QoreValue& data, PackContext& ctx, ExceptionSink* xsink);
+
+//! Append the packed data to the binary (or nothing) value of the passed reference.
+DLLLOCAL size_t msgpack_pack_into(const ReferenceNode* ref, QoreValue& data, PackContext& ctx, ExceptionSink* xsink);
+
+DLLLOCAL inline size_t msgpack_pack_into(const ReferenceNode* ref, QoreValue& data, OperationMode mode, ExceptionSink* xsink) {
+    PackContext ctx(mode);
+    return msgpack_pack_into(ref, data, ctx, xsink);
+}
+
+//! Pack the data into an output stream through a fixed-size writer buffer.
+DLLLOCAL void msgpack_pack_to_stream(OutputStream* os, QoreValue& data, PackContext& ctx, ExceptionSink* xsink);
+
+DLLLOCAL inline void msgpack_pack_to_stream(OutputStream* os, QoreValue& data, OperationMode mode, ExceptionSink* xsink) {
+    PackContext ctx(mode);
+    msgpack_pack_to_stream(os, data, ctx, xsink);
+}
 
 } // namespace intern
 } // namespace msgpack
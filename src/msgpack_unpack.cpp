@@ -29,10 +29,16 @@
 
 // std
 #include <climits>
+#include <cstdarg>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
 
 // module sources
 #include "msgpack_extensions.h"
+#include "MsgPackWorkStack.h"
 #include "MsgPackException.h"
 #include "MsgPackExtension.h"
 #include "QC_MsgPackExtension.h"
@@ -40,18 +46,70 @@
 namespace msgpack {
 namespace intern {
 
-QoreListNode* msgpack_unpack_array(mpack_reader_t* reader, mpack_tag_t tag, OperationMode mode, ExceptionSink* xsink) {
-    // prepare list
-    ReferenceHolder<QoreListNode> list(new QoreListNode, xsink);
+// Returns the number of bytes left in a reader over a buffer; readers filled from a stream are not bounded.
+static size_t msgpack_reader_available(mpack_reader_t* reader) {
+    // mpack_reader_remaining() cannot be used while a value is being read with read tracking enabled
+    if (reader->fill)
+        return SIZE_MAX;
+    return static_cast<size_t>(reader->end - reader->data);
+}
+
+// Flags an exceeded limit; the message is reported instead of the reader error.
+static void msgpack_limit_error(mpack_reader_t* reader, UnpackContext& ctx, const char* fmt, ...) {
+    char buf[128];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    ctx.error = buf;
+    mpack_reader_flag_error(reader, mpack_error_too_big);
+}
 
-    // read all elements
-    uint32_t size = mpack_tag_array_count(&tag);
-    for (uint32_t i = 0; i < size; i++) {
-        list->push(msgpack_unpack_value(reader, mode, xsink), xsink);
+// Counts \a count list, hash or typed array elements against the element limit.
+static bool msgpack_check_elements(mpack_reader_t* reader, UnpackContext& ctx, size_t count) {
+    if (!ctx.limits)
+        return true;
+    if (count > ctx.limits->maxElements - ctx.elements) {
+        msgpack_limit_error(reader, ctx, "number of elements exceeds the limit of %zu", ctx.limits->maxElements);
+        return false;
     }
+    ctx.elements += count;
+    return true;
+}
 
-    mpack_done_array(reader);
-    return list.release();
+// Checks a list or hash with \a count elements before unpacking it; each element takes at least \a minSize bytes.
+static bool msgpack_check_container(mpack_reader_t* reader, UnpackContext& ctx, uint32_t count, size_t minSize) {
+    if (static_cast<uint64_t>(count) * minSize > msgpack_reader_available(reader)) {
+        mpack_reader_flag_error(reader, mpack_error_invalid);
+        return false;
+    }
+    if (!ctx.limits)
+        return true;
+    if (ctx.depth >= ctx.limits->maxDepth) {
+        msgpack_limit_error(reader, ctx, "nesting depth exceeds the limit of %zu", ctx.limits->maxDepth);
+        return false;
+    }
+    return msgpack_check_elements(reader, ctx, count);
+}
+
+// Checks the size of a string, binary or extension before allocating memory for it.
+static bool msgpack_check_payload(mpack_reader_t* reader, UnpackContext& ctx, uint32_t size, size_t UnpackLimits::*limit, const char* what) {
+    if (size > msgpack_reader_available(reader)) {
+        mpack_reader_flag_error(reader, mpack_error_invalid);
+        return false;
+    }
+    if (!ctx.limits)
+        return true;
+    if (size > ctx.limits->*limit) {
+        msgpack_limit_error(reader, ctx, "%s size %u exceeds the limit of %zu bytes", what, size, ctx.limits->*limit);
+        return false;
+    }
+    if (size > ctx.limits->maxAllocSize - ctx.allocated) {
+        msgpack_limit_error(reader, ctx, "total size of strings, binaries and extensions exceeds the limit of %zu bytes", ctx.limits->maxAllocSize);
+        return false;
+    }
+    ctx.allocated += size;
+    return true;
 }
 
 BinaryNode* msgpack_unpack_binary(mpack_reader_t* reader, mpack_tag_t tag, ExceptionSink* xsink) {
@@ -68,75 +126,102 @@ BinaryNode* msgpack_unpack_binary(mpack_reader_t* reader, mpack_tag_t tag, Excep
     return bin.release();
 }
 
-AbstractQoreNode* msgpack_unpack_ext(mpack_reader_t* reader, mpack_tag_t tag, OperationMode mode, ExceptionSink* xsink) {
-    switch (mode) {
-        case MSGPACK_SIMPLE_MODE: {
-            // handle MessagePack built-in extension types first
-            if (mpack_tag_ext_exttype(&tag) == MPACK_EXTTYPE_TIMESTAMP)
-                return msgpack_unpack_ext_timestamp(reader, tag, xsink);
-
-            // otherwise unpack as an extension object
-            uint32_t size = mpack_tag_ext_length(&tag);
-            SimpleRefHolder<BinaryNode> bin(new BinaryNode);
-            bin->preallocate(size);
-            mpack_read_bytes(reader, (char*) bin->getPtr(), size);
-            mpack_done_ext(reader);
-            return new QoreObject(QC_MSGPACKEXTENSION, getProgram(), new MsgPackExtension(mpack_tag_ext_exttype(&tag), bin.release()));
-        }
-        case MSGPACK_QORE_MODE: {
-            switch (mpack_tag_ext_exttype(&tag)) {
-                // MessagePack built-in types
-                case MPACK_EXTTYPE_TIMESTAMP:
-                    return msgpack_unpack_ext_timestamp(reader, tag, xsink);
-
-                // Qore extension types
-                case MSGPACK_EXT_QORE_NULL:
-                    return msgpack_unpack_ext_null(reader, tag, xsink);
-                case MSGPACK_EXT_QORE_DATE:
-                    return msgpack_unpack_ext_date(reader, tag, xsink);
-                case MSGPACK_EXT_QORE_NUMBER:
-                    return msgpack_unpack_ext_number(reader, tag, xsink);
-                case MSGPACK_EXT_QORE_STRING:
-                    return msgpack_unpack_ext_string(reader, tag, xsink);
-                default:
-                    mpack_reader_flag_error(reader, mpack_error_data);
-                    break;
-            }
-            break;
+template <OperationMode Mode>
+static AbstractQoreNode* msgpack_unpack_ext(mpack_reader_t* reader, mpack_tag_t tag, UnpackContext& ctx, ExceptionSink* xsink) {
+    if (Mode == MSGPACK_SIMPLE_MODE) {
+        // handle MessagePack built-in extension types first
+        if (mpack_tag_ext_exttype(&tag) == MPACK_EXTTYPE_TIMESTAMP)
+            return msgpack_unpack_ext_timestamp(reader, tag, xsink);
+
+        // otherwise unpack as an extension object
+        uint32_t size = mpack_tag_ext_length(&tag);
+        SimpleRefHolder<BinaryNode> bin(new BinaryNode);
+        bin->preallocate(size);
+        mpack_read_bytes(reader, (char*) bin->getPtr(), size);
+        mpack_done_ext(reader);
+        return new QoreObject(QC_MSGPACKEXTENSION, getProgram(), new MsgPackExtension(mpack_tag_ext_exttype(&tag), bin.release()));
+    }
+
+    switch (mpack_tag_ext_exttype(&tag)) {
+        // MessagePack built-in types
+        case MPACK_EXTTYPE_TIMESTAMP:
+            return msgpack_unpack_ext_timestamp(reader, tag, xsink);
+
+        // Qore extension types
+        case MSGPACK_EXT_QORE_NULL:
+            return msgpack_unpack_ext_null(reader, tag, xsink);
+        case MSGPACK_EXT_QORE_DATE:
+            return msgpack_unpack_ext_date(reader, tag, xsink);
+        case MSGPACK_EXT_QORE_NUMBER:
+            return msgpack_unpack_ext_number(reader, tag, xsink);
+        case MSGPACK_EXT_QORE_STRING:
+            return msgpack_unpack_ext_string(reader, tag, xsink);
+        case MSGPACK_EXT_QORE_TYPED_ARRAY: {
+            // the elements of typed arrays count against the element limit like list elements
+            TypedArrayExtensionType arrayType;
+            size_t count;
+            if (!msgpack_unpack_typed_array_header(reader, tag, arrayType, count) || !msgpack_check_elements(reader, ctx, count))
+                return nullptr;
+            return msgpack_unpack_typed_array_elements(reader, arrayType, count, xsink);
         }
         default:
+            mpack_reader_flag_error(reader, mpack_error_data);
             break;
     }
-
     return nullptr;
 }
 
-QoreHashNode* msgpack_unpack_map(mpack_reader_t* reader, mpack_tag_t tag, OperationMode mode, ExceptionSink* xsink) {
-    // prepare hash
-    ReferenceHolder<QoreHashNode> hash(new QoreHashNode, xsink);
-
-    // read all elements
-    uint32_t size = mpack_tag_map_count(&tag);
-    for (uint32_t i = 0; i < size; i++) {
-        // read key and value
-        ValueHolder key(msgpack_unpack_value(reader, mode, xsink), xsink);
-        ValueHolder value(msgpack_unpack_value(reader, mode, xsink), xsink);
-
-        // check key and value
-        if (!(*key || *value) || key->getType() != NT_STRING) {
-            mpack_reader_flag_error(reader, mpack_error_data);
+AbstractQoreNode* msgpack_unpack_ext(mpack_reader_t* reader, mpack_tag_t tag, OperationMode mode, ExceptionSink* xsink) {
+    UnpackContext ctx(mode);
+    switch (mode) {
+        case MSGPACK_SIMPLE_MODE:
+            return msgpack_unpack_ext<MSGPACK_SIMPLE_MODE>(reader, tag, ctx, xsink);
+        case MSGPACK_QORE_MODE:
+            return msgpack_unpack_ext<MSGPACK_QORE_MODE>(reader, tag, ctx, xsink);
+        default:
             break;
-        }
-
-        // add element to hash
-        hash->setKeyValue(key->get<QoreStringNode>()->c_str(), value.release(), xsink);
     }
+    return nullptr;
+}
 
-    mpack_done_map(reader);
-    return hash.release();
+// Reads a string map key through the key cache; returns null if the key cannot be read in place.
+static const std::string* msgpack_unpack_cached_key(mpack_reader_t* reader, UnpackContext& ctx, std::string& tmp) {
+    mpack_tag_t tag = mpack_peek_tag(reader);
+    if (mpack_tag_type(&tag) != mpack_type_str)
+        return nullptr;
+    uint32_t len = mpack_tag_str_length(&tag);
+    if (!mpack_should_read_bytes_inplace(reader, len))
+        return nullptr;
+
+    // cached keys count against the limits like other strings
+    mpack_read_tag(reader);
+    if (!msgpack_check_payload(reader, ctx, len, &UnpackLimits::maxStrSize, "string"))
+        return &tmp;
+    const char* bytes = mpack_read_bytes_inplace(reader, len);
+    if (!bytes)
+        return &tmp;
+
+    // cached keys are known to be valid UTF-8; keys are validated before they are cached even for
+    // trusted input, as the cache is shared with later calls that may not trust their input
+    const std::string* key = ctx.keyCache->find(bytes, len);
+    if (!key) {
+        bool valid = msgpack_utf8_check(bytes, len);
+        if (!valid && !ctx.trusted) {
+            mpack_reader_flag_error(reader, mpack_error_type);
+            return &tmp;
+        }
+        if (valid)
+            key = ctx.keyCache->insert(bytes, len);
+        if (!key) {
+            tmp.assign(bytes, len);
+            key = &tmp;
+        }
+    }
+    mpack_done_str(reader);
+    return key;
 }
 
-QoreStringNode* msgpack_unpack_string(mpack_reader_t* reader, mpack_tag_t tag, ExceptionSink* xsink) {
+QoreStringNode* msgpack_unpack_string(mpack_reader_t* reader, mpack_tag_t tag, UnpackContext& ctx, ExceptionSink* xsink) {
     uint32_t size = mpack_tag_str_length(&tag);
 
     // prepare string node and buffer for reading
@@ -145,8 +230,24 @@ QoreStringNode* msgpack_unpack_string(mpack_reader_t* reader, mpack_tag_t tag, E
     qore_size_t allocated = str->capacity();
     char* buffer = str->giveBuffer();
 
-    // read string
-    mpack_read_utf8(reader, buffer, size);
+    // read string; data in the reader's buffer is validated while copying it, trusted input is only copied
+    bool valid;
+    if (mpack_should_read_bytes_inplace(reader, size)) {
+        const char* bytes = mpack_read_bytes_inplace(reader, size);
+        if (bytes && ctx.trusted) {
+            memcpy(buffer, bytes, size);
+            valid = true;
+        }
+        else {
+            valid = bytes && msgpack_utf8_copy(buffer, bytes, size);
+        }
+    }
+    else {
+        mpack_read_bytes(reader, buffer, size);
+        valid = ctx.trusted || msgpack_utf8_check(buffer, size);
+    }
+    if (!valid && mpack_reader_error(reader) == mpack_ok)
+        mpack_reader_flag_error(reader, mpack_error_type);
     buffer[size] = '\0';
     str->set(buffer, size, allocated, QCS_UTF8);
 
@@ -155,30 +256,32 @@ QoreStringNode* msgpack_unpack_string(mpack_reader_t* reader, mpack_tag_t tag, E
 }
 
 
-QoreValue msgpack_unpack_value(mpack_reader_t* reader, OperationMode mode, ExceptionSink* xsink) {
-    mpack_tag_t tag = mpack_read_tag(reader);
-
+// Unpacks a value other than a list or hash.
+template <OperationMode Mode>
+static QoreValue msgpack_unpack_scalar(mpack_reader_t* reader, mpack_tag_t tag, UnpackContext& ctx, ExceptionSink* xsink) {
     switch (mpack_tag_type(&tag)) {
-        case mpack_type_array:
-            return msgpack_unpack_array(reader, tag, mode, xsink);
         case mpack_type_bin:
+            if (!msgpack_check_payload(reader, ctx, mpack_tag_bin_length(&tag), &UnpackLimits::maxBinSize, "binary"))
+                return QoreValue();
             return msgpack_unpack_binary(reader, tag, xsink);
         case mpack_type_bool:
             return mpack_tag_bool_value(&tag);
         case mpack_type_double:
             return mpack_tag_double_value(&tag);
         case mpack_type_ext:
-            return msgpack_unpack_ext(reader, tag, mode, xsink);
+            if (!msgpack_check_payload(reader, ctx, mpack_tag_ext_length(&tag), &UnpackLimits::maxExtSize, "extension"))
+                return QoreValue();
+            return msgpack_unpack_ext<Mode>(reader, tag, ctx, xsink);
         case mpack_type_float:
             return mpack_tag_float_value(&tag);
         case mpack_type_int:
             return mpack_tag_int_value(&tag);
-        case mpack_type_map:
-            return msgpack_unpack_map(reader, tag, mode, xsink);
         case mpack_type_nil:
             return QoreValue();
         case mpack_type_str:
-            return msgpack_unpack_string(reader, tag, xsink);
+            if (!msgpack_check_payload(reader, ctx, mpack_tag_str_length(&tag), &UnpackLimits::maxStrSize, "string"))
+                return QoreValue();
+            return msgpack_unpack_string(reader, tag, ctx, xsink);
         case mpack_type_uint: {
             uint64_t val = mpack_tag_uint_value(&tag);
             if (val <= LLONG_MAX)
@@ -192,12 +295,538 @@ QoreValue msgpack_unpack_value(mpack_reader_t* reader, OperationMode mode, Excep
     return QoreValue();
 }
 
+namespace {
+
+// A list or hash whose elements are being unpacked.
+struct UnpackFrame {
+    //! The list being filled, if any.
+    ReferenceHolder<QoreListNode> list;
+    //! The hash being filled, if any.
+    ReferenceHolder<QoreHashNode> hash;
+    //! Number of list elements or hash entries still to be read.
+    uint32_t remaining;
+    //! Key of the hash entry whose value is read next (in the key cache or keyBuf); null if a key is read next.
+    const std::string* key = nullptr;
+    std::string keyBuf;
+    //! Projection applied to the hash or to all elements of the list; null if all entries are unpacked.
+    const QoreHashNode* projection = nullptr;
+
+    DLLLOCAL UnpackFrame(QoreListNode* l, uint32_t count, ExceptionSink* xsink) : list(l, xsink), hash(xsink), remaining(count) {}
+    DLLLOCAL UnpackFrame(QoreHashNode* h, uint32_t count, ExceptionSink* xsink) : list(xsink), hash(h, xsink), remaining(count) {}
+};
+
+typedef MsgPackWorkStack<UnpackFrame> UnpackFrameStack;
+
+// Reads the key of the next entry of the hash on top of the stack; returns false on error.
+template <OperationMode Mode>
+bool msgpack_unpack_key(mpack_reader_t* reader, UnpackContext& ctx, UnpackFrame& frame, ExceptionSink* xsink) {
+    // read the key without creating a string node if the key cache is used
+    if (ctx.keyCache) {
+        frame.key = msgpack_unpack_cached_key(reader, ctx, frame.keyBuf);
+        if (frame.key)
+            return mpack_reader_error(reader) == mpack_ok;
+    }
+
+    mpack_tag_t tag = mpack_read_tag(reader);
+    mpack_type_t type = mpack_tag_type(&tag);
+    if (type != mpack_type_array && type != mpack_type_map) {
+        ValueHolder key(msgpack_unpack_scalar<Mode>(reader, tag, ctx, xsink), xsink);
+        if (key->getType() == NT_STRING) {
+            frame.keyBuf.assign(key->get<const QoreStringNode>()->c_str());
+            frame.key = &frame.keyBuf;
+            return true;
+        }
+    }
+    if (mpack_reader_error(reader) == mpack_ok)
+        mpack_reader_flag_error(reader, mpack_error_data);
+    return false;
+}
+
+// A list or hash being skipped.
+struct SkipFrame {
+    bool map;
+    //! Number of values still to be skipped (map keys and values both count).
+    uint64_t remaining;
+
+    DLLLOCAL SkipFrame(bool m, uint64_t count) : map(m), remaining(count) {}
+};
+
+// Skips the next value without creating it; nested lists and hashes are skipped iteratively.
+void msgpack_skip_value(mpack_reader_t* reader, UnpackContext& ctx) {
+    MsgPackWorkStack<SkipFrame> frames;
+
+    while (true) {
+        mpack_tag_t tag = mpack_read_tag(reader);
+        if (mpack_reader_error(reader) != mpack_ok)
+            return;
+
+        switch (mpack_tag_type(&tag)) {
+            case mpack_type_str:
+                mpack_skip_bytes(reader, mpack_tag_str_length(&tag));
+                mpack_done_str(reader);
+                break;
+            case mpack_type_bin:
+                mpack_skip_bytes(reader, mpack_tag_bin_length(&tag));
+                mpack_done_bin(reader);
+                break;
+            case mpack_type_ext:
+                mpack_skip_bytes(reader, mpack_tag_ext_length(&tag));
+                mpack_done_ext(reader);
+                break;
+            case mpack_type_array:
+            case mpack_type_map: {
+                bool map = mpack_tag_type(&tag) == mpack_type_map;
+                uint64_t count = map ? static_cast<uint64_t>(mpack_tag_map_count(&tag)) * 2 : mpack_tag_array_count(&tag);
+                if (count) {
+                    // skipped lists and hashes are not created, but their nesting is still limited
+                    if (ctx.limits && ctx.depth + frames.size() >= ctx.limits->maxDepth) {
+                        msgpack_limit_error(reader, ctx, "nesting depth exceeds the limit of %zu", ctx.limits->maxDepth);
+                        return;
+                    }
+                    frames.push(map, count);
+                    continue;
+                }
+                if (map)
+                    mpack_done_map(reader);
+                else
+                    mpack_done_array(reader);
+                break;
+            }
+            default:
+                break;
+        }
+        if (mpack_reader_error(reader) != mpack_ok)
+            return;
+
+        // complete all lists and hashes ended by the value
+        while (!frames.empty()) {
+            SkipFrame& frame = frames.top();
+            if (--frame.remaining)
+                break;
+            if (frame.map)
+                mpack_done_map(reader);
+            else
+                mpack_done_array(reader);
+            frames.pop();
+        }
+        if (frames.empty())
+            return;
+    }
+}
+
+template <OperationMode Mode>
+QoreValue msgpack_unpack_value(mpack_reader_t* reader, UnpackContext& ctx, const QoreHashNode* projection, ExceptionSink* xsink) {
+    // lists and hashes being filled; they are released if unpacking fails
+    UnpackFrameStack frames;
+
+    while (true) {
+        // read the key of the next hash entry and select the projection of the next value
+        bool skip = false;
+        if (!frames.empty()) {
+            UnpackFrame& frame = frames.top();
+            projection = frame.projection;
+            if (frame.hash && !frame.key) {
+                if (!msgpack_unpack_key<Mode>(reader, ctx, frame, xsink))
+                    return QoreValue();
+                if (projection) {
+                    // a hash selects the entry with a nested projection, other values select or skip it entirely
+                    bool exists;
+                    QoreValue sub = projection->getKeyValueExistence(frame.key->c_str(), exists);
+                    projection = sub.getType() == NT_HASH ? sub.get<const QoreHashNode>() : nullptr;
+                    skip = !projection && (!exists || !sub.getAsBool());
+                }
+            }
+        }
+
+        // read the next value; lists and hashes with elements are filled by the following iterations
+        QoreValue value;
+        if (skip) {
+            msgpack_skip_value(reader, ctx);
+        }
+        else {
+            mpack_tag_t tag = mpack_read_tag(reader);
+            switch (mpack_tag_type(&tag)) {
+                case mpack_type_array: {
+                    uint32_t count = mpack_tag_array_count(&tag);
+                    if (!msgpack_check_container(reader, ctx, count, 1))
+                        return QoreValue();
+                    if (count) {
+                        frames.push(new QoreListNode, count, xsink).projection = projection;
+                        ++ctx.depth;
+                        continue;
+                    }
+                    mpack_done_array(reader);
+                    value = new QoreListNode;
+                    break;
+                }
+                case mpack_type_map: {
+                    uint32_t count = mpack_tag_map_count(&tag);
+                    if (!msgpack_check_container(reader, ctx, count, 2))
+                        return QoreValue();
+                    if (count) {
+                        frames.push(new QoreHashNode, count, xsink).projection = projection;
+                        ++ctx.depth;
+                        continue;
+                    }
+                    mpack_done_map(reader);
+                    value = new QoreHashNode;
+                    break;
+                }
+                default:
+                    value = msgpack_unpack_scalar<Mode>(reader, tag, ctx, xsink);
+                    break;
+            }
+        }
+        if (mpack_reader_error(reader) != mpack_ok) {
+            value.discard(xsink);
+            return QoreValue();
+        }
+
+        // add the value to the list or hash on top of the stack, completing all lists and hashes filled by it
+        while (!frames.empty()) {
+            UnpackFrame& frame = frames.top();
+            if (skip) {
+                skip = false;
+                frame.key = nullptr;
+            }
+            else if (frame.list) {
+                frame.list->push(value, xsink);
+            }
+            else {
+                frame.hash->setKeyValue(frame.key->c_str(), value, xsink);
+                frame.key = nullptr;
+            }
+            if (--frame.remaining)
+                break;
+
+            if (frame.list) {
+                mpack_done_array(reader);
+                value = frame.list.release();
+            }
+            else {
+                mpack_done_map(reader);
+                value = frame.hash.release();
+            }
+            --ctx.depth;
+            frames.pop();
+        }
+        if (frames.empty())
+            return value;
+    }
+}
+
+} // namespace
+
+QoreValue msgpack_unpack_value(mpack_reader_t* reader, UnpackContext& ctx, const QoreHashNode* projection, ExceptionSink* xsink) {
+    switch (ctx.mode) {
+        case MSGPACK_SIMPLE_MODE:
+            return msgpack_unpack_value<MSGPACK_SIMPLE_MODE>(reader, ctx, projection, xsink);
+        case MSGPACK_QORE_MODE:
+            return msgpack_unpack_value<MSGPACK_QORE_MODE>(reader, ctx, projection, xsink);
+        default:
+            break;
+    }
+    return QoreValue();
+}
+
+
+//-------------------------
+// Unpacking limits
+//-------------------------
+
+int msgpack_get_limits(const QoreHashNode* h, UnpackLimits& limits, ExceptionSink* xsink) {
+    if (!h)
+        return 0;
+
+    ConstHashIterator i(h);
+    while (i.next()) {
+        const char* key = i.getKey();
+        size_t* limit;
+        if (!strcmp(key, "max_depth"))
+            limit = &limits.maxDepth;
+        else if (!strcmp(key, "max_elements"))
+            limit = &limits.maxElements;
+        else if (!strcmp(key, "max_str_size"))
+            limit = &limits.maxStrSize;
+        else if (!strcmp(key, "max_bin_size"))
+            limit = &limits.maxBinSize;
+        else if (!strcmp(key, "max_ext_size"))
+            limit = &limits.maxExtSize;
+        else if (!strcmp(key, "max_alloc_size"))
+            limit = &limits.maxAllocSize;
+        else {
+            xsink->raiseException("INVALID-LIMIT", "unknown limit '%s'", key);
+            return -1;
+        }
+
+        QoreValue v = i.get();
+        if (v.isNothing())
+            continue;
+        int64 val = v.getAsBigInt();
+        if (val < 0) {
+            xsink->raiseException("INVALID-LIMIT", "limit '%s' must not be negative; got: " QLLD, key, val);
+            return -1;
+        }
+        *limit = static_cast<size_t>(val);
+    }
+    return 0;
+}
+
+QoreHashNode* msgpack_limits_to_hash(const UnpackLimits& limits, ExceptionSink* xsink) {
+    ReferenceHolder<QoreHashNode> h(new QoreHashNode(bigIntTypeInfo), xsink);
+    const std::pair<const char*, size_t> values[] = {
+        {"max_depth", limits.maxDepth},
+        {"max_elements", limits.maxElements},
+        {"max_str_size", limits.maxStrSize},
+        {"max_bin_size", limits.maxBinSize},
+        {"max_ext_size", limits.maxExtSize},
+        {"max_alloc_size", limits.maxAllocSize},
+    };
+    for (const auto& v : values) {
+        if (v.second != SIZE_MAX)
+            h->setKeyValue(v.first, static_cast<int64>(v.second), xsink);
+    }
+    return h.release();
+}
+
+
+//-------------------------
+// Value boundary scanning
+//-------------------------
+
+bool msgpack_scan_header(const char* p, size_t avail, ScanHeader& hdr) {
+    uint8_t type = static_cast<uint8_t>(p[0]);
+    hdr.payload = 0;
+    hdr.children = 0;
+
+    // fixed size types and fix* families
+    if (type <= 0x7f || type >= 0xe0 || type == 0xc0 || type == 0xc2 || type == 0xc3) {
+        hdr.size = 1;
+        return true;
+    }
+    if (type <= 0x8f) {
+        hdr.size = 1;
+        hdr.children = 2 * static_cast<uint64_t>(type & 0x0f);
+        return true;
+    }
+    if (type <= 0x9f) {
+        hdr.size = 1;
+        hdr.children = type & 0x0f;
+        return true;
+    }
+    if (type <= 0xbf) {
+        hdr.size = 1;
+        hdr.payload = type & 0x1f;
+        return true;
+    }
+
+    switch (type) {
+        case 0xca: hdr.size = 1; hdr.payload = 4; return true;
+        case 0xcb: hdr.size = 1; hdr.payload = 8; return true;
+        case 0xcc: case 0xd0: hdr.size = 1; hdr.payload = 1; return true;
+        case 0xcd: case 0xd1: hdr.size = 1; hdr.payload = 2; return true;
+        case 0xce: case 0xd2: hdr.size = 1; hdr.payload = 4; return true;
+        case 0xcf: case 0xd3: hdr.size = 1; hdr.payload = 8; return true;
+        case 0xd4: hdr.size = 2; hdr.payload = 1; break;
+        case 0xd5: hdr.size = 2; hdr.payload = 2; break;
+        case 0xd6: hdr.size = 2; hdr.payload = 4; break;
+        case 0xd7: hdr.size = 2; hdr.payload = 8; break;
+        case 0xd8: hdr.size = 2; hdr.payload = 16; break;
+        // bin8, str8, ext8
+        case 0xc4: case 0xd9: hdr.size = 2; break;
+        case 0xc7: hdr.size = 3; break;
+        // bin16, str16, ext16, array16, map16
+        case 0xc5: case 0xda: case 0xdc: case 0xde: hdr.size = 3; break;
+        case 0xc8: hdr.size = 4; break;
+        // bin32, str32, ext32, array32, map32
+        case 0xc6: case 0xdb: case 0xdd: case 0xdf: hdr.size = 5; break;
+        case 0xc9: hdr.size = 6; break;
+        default:
+            throw getMsgPackException(mpack_error_invalid);
+    }
+
+    if (avail < hdr.size)
+        return false;
+
+    switch (type) {
+        case 0xc4: case 0xc7: case 0xd9: hdr.payload = static_cast<uint8_t>(p[1]); break;
+        case 0xc5: case 0xc8: case 0xda: hdr.payload = mpack_load_u16(p + 1); break;
+        case 0xc6: case 0xc9: case 0xdb: hdr.payload = mpack_load_u32(p + 1); break;
+        case 0xdc: hdr.children = mpack_load_u16(p + 1); break;
+        case 0xdd: hdr.children = mpack_load_u32(p + 1); break;
+        case 0xde: hdr.children = 2 * static_cast<uint64_t>(mpack_load_u16(p + 1)); break;
+        case 0xdf: hdr.children = 2 * static_cast<uint64_t>(mpack_load_u32(p + 1)); break;
+        default: break;
+    }
+    return true;
+}
+
+size_t msgpack_scan_value(const char* data, size_t size, size_t offset) {
+    uint64_t items = 1;
+    while (items) {
+        ScanHeader hdr;
+        if (offset >= size || !msgpack_scan_header(data + offset, size - offset, hdr))
+            throw getMsgPackException(mpack_error_invalid);
+        offset += hdr.size;
+        if (hdr.payload > size - offset)
+            throw getMsgPackException(mpack_error_invalid);
+        offset += hdr.payload;
+        items += hdr.children - 1;
+    }
+    return offset;
+}
+
+
+//-------------------------
+// Path access
+//-------------------------
+
+int msgpack_parse_path_segment(const char* path, size_t len, size_t& pos, PathSegment& seg, ExceptionSink* xsink) {
+    // list element
+    if (path[pos] == '[') {
+        size_t start = ++pos;
+        seg.isIndex = true;
+        seg.index = 0;
+        while (pos < len && path[pos] >= '0' && path[pos] <= '9')
+            seg.index = seg.index * 10 + (path[pos++] - '0');
+        if (pos == start || pos == len || path[pos] != ']') {
+            xsink->raiseException("INVALID-PATH", "invalid list index in path '%s'", path);
+            return -1;
+        }
+        ++pos;
+        return 0;
+    }
+
+    // hash key
+    if (path[pos] == '.' && pos)
+        ++pos;
+    size_t start = pos;
+    while (pos < len && path[pos] != '.' && path[pos] != '[')
+        ++pos;
+    if (pos == start) {
+        xsink->raiseException("INVALID-PATH", "empty key in path '%s'", path);
+        return -1;
+    }
+    seg.isIndex = false;
+    seg.key = path + start;
+    seg.len = pos - start;
+    return 0;
+}
+
+bool msgpack_key_equals(const char* data, size_t size, size_t offset, const char* key, size_t len, OperationMode mode, ExceptionSink* xsink) {
+    // compare UTF-8 keys in place
+    if (msgpack_is_str_type(static_cast<uint8_t>(data[offset]))) {
+        ScanHeader hdr;
+        if (!msgpack_scan_header(data + offset, size - offset, hdr) || hdr.payload > size - offset - hdr.size)
+            throw getMsgPackException(mpack_error_invalid);
+        return hdr.payload == len && !memcmp(data + offset + hdr.size, key, len);
+    }
+
+    // other keys (e.g. strings with a different encoding in Qore mode) have to be decoded
+    ValueHolder k(msgpack_unpack_at(data, size, offset, mode, xsink), xsink);
+    if (*xsink || k->getType() != NT_STRING)
+        return false;
+    TempEncodingHelper str(k->get<const QoreStringNode>(), QCS_UTF8, xsink);
+    if (!str)
+        return false;
+    return str->size() == len && !memcmp(str->c_str(), key, len);
+}
+
+QoreValue msgpack_unpack_at(const char* data, size_t size, size_t offset, OperationMode mode, ExceptionSink* xsink) {
+    size_t end = msgpack_scan_value(data, size, offset);
+
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, data + offset, end - offset);
+    ValueHolder value(msgpack_unpack_value(&reader, mode, xsink), xsink);
+    mpack_error_t error = mpack_reader_destroy(&reader);
+    if (error != mpack_ok)
+        throw getMsgPackException(error);
+    return value.release();
+}
+
+QoreValue msgpack_get(const BinaryNode* data, const QoreString* path, OperationMode mode, ExceptionSink* xsink) {
+    const char* buffer = static_cast<const char*>(data->getPtr());
+    size_t size = data->size();
+
+    // return nothing if no data
+    if (buffer == nullptr || size == 0)
+        return QoreValue();
+
+    TempEncodingHelper p(path, QCS_UTF8, xsink);
+    if (!p)
+        return QoreValue();
+
+    const char* str = p->c_str();
+    size_t len = p->size();
+    size_t pos = 0;
+    size_t offset = 0;
+
+    while (pos < len) {
+        PathSegment seg;
+        if (msgpack_parse_path_segment(str, len, pos, seg, xsink))
+            return QoreValue();
+
+        if (offset >= size)
+            throw getMsgPackException(mpack_error_invalid);
+        uint8_t type = static_cast<uint8_t>(buffer[offset]);
+        ScanHeader hdr;
+        if (!msgpack_scan_header(buffer + offset, size - offset, hdr))
+            throw getMsgPackException(mpack_error_invalid);
+        size_t elem = offset + hdr.size;
+
+        if (seg.isIndex) {
+            if (!msgpack_is_array_type(type) || seg.index >= hdr.children)
+                return QoreValue();
+            // skip preceding elements without decoding them
+            for (size_t i = 0; i < seg.index; ++i)
+                elem = msgpack_scan_value(buffer, size, elem);
+            offset = elem;
+            continue;
+        }
+
+        if (!msgpack_is_map_type(type))
+            return QoreValue();
+
+        // the last occurrence of a duplicate key wins, like when unpacking into a hash
+        size_t found = 0;
+        for (uint64_t i = 0, e = hdr.children / 2; i < e; ++i) {
+            size_t value = msgpack_scan_value(buffer, size, elem);
+            if (msgpack_key_equals(buffer, size, elem, seg.key, seg.len, mode, xsink))
+                found = value;
+            if (*xsink)
+                return QoreValue();
+            elem = msgpack_scan_value(buffer, size, value);
+        }
+        if (!found)
+            return QoreValue();
+        offset = found;
+    }
+
+    return msgpack_unpack_at(buffer, size, offset, mode, xsink);
+}
+
 
 //-------------------------
 // msgpack_unpack function
 //-------------------------
 
-QoreValue msgpack_unpack(const BinaryNode* data, OperationMode mode, ExceptionSink* xsink) {
+// Adds the next top-level value; multiple top-level values are returned as a list.
+static void msgpack_unpack_add(ValueHolder& unpacked, QoreValue node, ExceptionSink* xsink) {
+    if (*unpacked) {
+        ReferenceHolder<QoreListNode> list(xsink);
+        if (unpacked->getType() == NT_LIST)
+            list = unpacked.release().get<QoreListNode>();
+        else
+            list = new QoreListNode(autoTypeInfo);
+        list->push(node, xsink);
+        unpacked = list.release();
+    }
+    else {
+        unpacked = node;
+    }
+}
+
+static QoreValue msgpack_unpack_data(const BinaryNode* data, const QoreHashNode* projection, UnpackContext& ctx, ExceptionSink* xsink) {
     ValueHolder unpacked(xsink);
     const char* dataCheck = nullptr;
     const char* buffer = static_cast<const char*>(data->getPtr());
@@ -214,19 +843,7 @@ QoreValue msgpack_unpack(const BinaryNode* data, OperationMode mode, ExceptionSi
 
     // unpack the data
     do {
-        QoreValue node = msgpack_unpack_value(&reader, mode, xsink);
-        if (*unpacked) {
-            ReferenceHolder<QoreListNode> list(xsink);
-            if (unpacked->getType() == NT_LIST)
-                list = unpacked.release().get<QoreListNode>();
-            else
-                list = new QoreListNode(autoTypeInfo);
-            list->push(node, xsink);
-            unpacked = list.release();
-        }
-        else {
-            unpacked = node;
-        }
+        msgpack_unpack_add(unpacked, msgpack_unpack_value(&reader, ctx, projection, xsink), xsink);
         remaining = mpack_reader_remaining(&reader, &dataCheck);
     }
     while (remaining && dataCheck);
@@ -234,6 +851,8 @@ QoreValue msgpack_unpack(const BinaryNode* data, OperationMode mode, ExceptionSi
     // finish reading
     mpack_error_t result = mpack_reader_destroy(&reader);
     if (result != mpack_ok) {
+        if (!ctx.error.empty())
+            throw msgpack::MsgPackExceptionMaker("%s", ctx.error.c_str());
         throw msgpack::getMsgPackException(result);
     }
 
@@ -241,5 +860,89 @@ QoreValue msgpack_unpack(const BinaryNode* data, OperationMode mode, ExceptionSi
     return unpacked.release();
 }
 
+QoreValue msgpack_unpack(const BinaryNode* data, UnpackContext& ctx, ExceptionSink* xsink) {
+    return msgpack_unpack_data(data, nullptr, ctx, xsink);
+}
+
+QoreValue msgpack_unpack_projected(const BinaryNode* data, const QoreHashNode* projection, UnpackContext& ctx, ExceptionSink* xsink) {
+    return msgpack_unpack_data(data, projection, ctx, xsink);
+}
+
+
+//---------------------------
+// Input stream fill source
+//---------------------------
+
+static size_t msgpack_stream_reader_fill(mpack_reader_t* reader, char* buffer, size_t count) {
+    StreamReaderContext* ctx = static_cast<StreamReaderContext*>(mpack_reader_context(reader));
+    int64 read = ctx->is->read(buffer, static_cast<int64>(count), ctx->xsink);
+    if (*ctx->xsink) {
+        mpack_reader_flag_error(reader, mpack_error_io);
+        return 0;
+    }
+    // the stream ended in the middle of a value
+    if (read <= 0) {
+        mpack_reader_flag_error(reader, mpack_error_eof);
+        return 0;
+    }
+    return static_cast<size_t>(read);
+}
+
+static void msgpack_stream_reader_skip(mpack_reader_t* reader, size_t count) {
+    char buffer[MPACK_BUFFER_SIZE];
+    while (count) {
+        size_t chunk = count < sizeof(buffer) ? count : sizeof(buffer);
+        size_t read = msgpack_stream_reader_fill(reader, buffer, chunk);
+        if (!read)
+            return;
+        count -= read;
+    }
+}
+
+void msgpack_stream_reader_init(mpack_reader_t* reader, char* buffer, size_t size, StreamReaderContext* ctx) {
+    mpack_reader_init(reader, buffer, size, 0);
+    mpack_reader_set_context(reader, ctx);
+    mpack_reader_set_fill(reader, msgpack_stream_reader_fill);
+    mpack_reader_set_skip(reader, msgpack_stream_reader_skip);
+}
+
+QoreValue msgpack_unpack_from_stream(InputStream* is, UnpackContext& ctx, ExceptionSink* xsink) {
+    ValueHolder unpacked(xsink);
+    char buffer[MPACK_BUFFER_SIZE];
+    StreamReaderContext streamCtx = {is, xsink};
+
+    // return nothing if no data
+    if (is->peek(xsink) < 0 || *xsink)
+        return QoreValue();
+
+    // initialize reader filling its buffer from the stream on demand
+    mpack_reader_t reader;
+    msgpack_stream_reader_init(&reader, buffer, sizeof(buffer), &streamCtx);
+
+    // unpack values until the stream is exhausted
+    do {
+        msgpack_unpack_add(unpacked, msgpack_unpack_value(&reader, ctx, xsink), xsink);
+        if (mpack_reader_error(&reader) != mpack_ok)
+            break;
+    }
+    while (mpack_reader_remaining(&reader, nullptr) || (is->peek(xsink) >= 0 && !*xsink));
+
+    // finish reading
+    mpack_error_t result = mpack_reader_destroy(&reader);
+    if (result != mpack_ok) {
+        // stream errors have already been raised by the stream
+        if (result == mpack_error_io && *xsink)
+            return QoreValue();
+        if (!ctx.error.empty())
+            throw msgpack::MsgPackExceptionMaker("%s", ctx.error.c_str());
+        throw msgpack::getMsgPackException(result);
+    }
+    if (*xsink)
+        return QoreValue();
+
+    // return unpacked Qore node
+    return unpacked.release();
+}
+
 } // namespace intern
 } // namespace msgpack
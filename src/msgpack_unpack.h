@@ -28,27 +28,172 @@
 #ifndef _QORE_MODULE_MSGPACK_MSGPACK_UNPACK_H
 #define _QORE_MODULE_MSGPACK_MSGPACK_UNPACK_H
 
+// std
+#include <cstdint>
+#include <string>
+
 // qore
 #include "qore/Qore.h"
+#include "qore/InputStream.h"
 
 // mpack library
 #include "mpack/mpack.h"
 
 // module sources
 #include "msgpack_enums.h"
+#include "MsgPackKeyCache.h"
+#include "msgpack_utf8.h"
 
 namespace msgpack {
 namespace intern {
 
-DLLLOCAL QoreListNode* msgpack_unpack_array(mpack_reader_t* reader, mpack_tag_t tag, OperationMode mode, ExceptionSink* xsink);
+//! Limits of unpacked data; all limits are disabled by default.
+struct UnpackLimits {
+    //! Maximum nesting depth of lists and hashes.
+    size_t maxDepth = SIZE_MAX;
+    //! Maximum total number of list elements and hash entries.
+    size_t maxElements = SIZE_MAX;
+    //! Maximum size of a single string in bytes.
+    size_t maxStrSize = SIZE_MAX;
+    //! Maximum size of a single binary in bytes.
+    size_t maxBinSize = SIZE_MAX;
+    //! Maximum size of a single extension's data in bytes.
+    size_t maxExtSize = SIZE_MAX;
+    //! Maximum total size of all strings, binaries and extension data in bytes.
+    size_t maxAllocSize = SIZE_MAX;
+};
+
+//! Read limits from a hash with \c max_depth, \c max_elements, \c max_str_size, \c max_bin_size, \c max_ext_size and \c max_alloc_size keys.
+DLLLOCAL int msgpack_get_limits(const QoreHashNode* h, UnpackLimits& limits, ExceptionSink* xsink);
+
+//! Create a hash of all enabled limits in the format accepted by msgpack_get_limits().
+DLLLOCAL QoreHashNode* msgpack_limits_to_hash(const UnpackLimits& limits, ExceptionSink* xsink);
+
+//! Per-call state of unpacking.
+struct UnpackContext {
+    OperationMode mode;
+    //! Optional cache of hash keys.
+    MsgPackKeyCache* keyCache = nullptr;
+    //! Input from a trusted producer; strings are copied without UTF-8 validation.
+    bool trusted = false;
+    //! Optional limits of unpacked data.
+    const UnpackLimits* limits = nullptr;
+
+    //! Current nesting depth of lists and hashes.
+    size_t depth = 0;
+    //! Number of list elements and hash entries unpacked so far.
+    size_t elements = 0;
+    //! Number of bytes of strings, binaries and extension data unpacked so far.
+    size_t allocated = 0;
+    //! Description of an exceeded limit.
+    std::string error;
+
+    DLLLOCAL UnpackContext(OperationMode m, MsgPackKeyCache* kc = nullptr, bool t = false, const UnpackLimits* l = nullptr)
+        : mode(m), keyCache(kc), trusted(t), limits(l) {}
+};
+
 DLLLOCAL BinaryNode* msgpack_unpack_binary(mpack_reader_t* reader, mpack_tag_t tag, ExceptionSink* xsink);
 DLLLOCAL AbstractQoreNode* msgpack_unpack_ext(mpack_reader_t* reader, mpack_tag_t tag, OperationMode mode, ExceptionSink* xsink);
-DLLLOCAL QoreHashNode* msgpack_unpack_map(mpack_reader_t* reader, mpack_tag_t tag, OperationMode mode, ExceptionSink* xsink);
-DLLLOCAL QoreStringNode* msgpack_unpack_string(mpack_reader_t* reader, mpack_tag_t tag, ExceptionSink* xsink);
-
-DLLLOCAL QoreValue msgpack_unpack_value(mpack_reader_t* reader, OperationMode mode, ExceptionSink* xsink);
-
-DLLLOCAL QoreValue msgpack_unpack(const BinaryNode* data, OperationMode mode, ExceptionSink* xsink);
+DLLLOCAL QoreStringNode* msgpack_unpack_string(mpack_reader_t* reader, mpack_tag_t tag, UnpackContext& ctx, ExceptionSink* xsink);
+
+//! Unpack a value; nested lists and hashes are unpacked iteratively using an explicit work stack.
+/** If \a projection is set, map entries not selected by it are skipped (it is applied to all maps in lists too).
+ */
+DLLLOCAL QoreValue msgpack_unpack_value(mpack_reader_t* reader, UnpackContext& ctx, const QoreHashNode* projection, ExceptionSink* xsink);
+
+DLLLOCAL inline QoreValue msgpack_unpack_value(mpack_reader_t* reader, UnpackContext& ctx, ExceptionSink* xsink) {
+    return msgpack_unpack_value(reader, ctx, nullptr, xsink);
+}
+
+DLLLOCAL inline QoreValue msgpack_unpack_value(mpack_reader_t* reader, OperationMode mode, ExceptionSink* xsink) {
+    UnpackContext ctx(mode);
+    return msgpack_unpack_value(reader, ctx, xsink);
+}
+
+//! Header of a single MessagePack value as seen by the boundary scanner.
+struct ScanHeader {
+    //! Size of the header (type byte and length/count fields).
+    size_t size;
+    //! Number of payload bytes following the header.
+    uint64_t payload;
+    //! Number of child values (map keys and values both count).
+    uint64_t children;
+};
+
+//! Check whether a type byte starts a map.
+DLLLOCAL inline bool msgpack_is_map_type(uint8_t type) {
+    return (type >= 0x80 && type <= 0x8f) || type == 0xde || type == 0xdf;
+}
+
+//! Check whether a type byte starts an array.
+DLLLOCAL inline bool msgpack_is_array_type(uint8_t type) {
+    return (type >= 0x90 && type <= 0x9f) || type == 0xdc || type == 0xdd;
+}
+
+//! Check whether a type byte starts a string.
+DLLLOCAL inline bool msgpack_is_str_type(uint8_t type) {
+    return (type >= 0xa0 && type <= 0xbf) || (type >= 0xd9 && type <= 0xdb);
+}
+
+//! Scan the header at \a p without decoding it; returns false if more than \a avail bytes are needed.
+DLLLOCAL bool msgpack_scan_header(const char* p, size_t avail, ScanHeader& hdr);
+
+//! Find the end offset of the value starting at \a offset without decoding it.
+DLLLOCAL size_t msgpack_scan_value(const char* data, size_t size, size_t offset);
+
+//! Single segment of a value path like \c "a.b[3]".
+struct PathSegment {
+    //! Whether the segment is a list index (otherwise a hash key).
+    bool isIndex;
+    size_t index;
+    //! Hash key (UTF-8, not terminated).
+    const char* key;
+    size_t len;
+};
+
+//! Parse the path segment at \a pos and advance it; returns -1 if an exception was raised.
+DLLLOCAL int msgpack_parse_path_segment(const char* path, size_t len, size_t& pos, PathSegment& seg, ExceptionSink* xsink);
+
+//! Check whether the map key at \a offset is equal to the UTF-8 string \a key.
+DLLLOCAL bool msgpack_key_equals(const char* data, size_t size, size_t offset, const char* key, size_t len, OperationMode mode, ExceptionSink* xsink);
+
+//! Decode the single value starting at \a offset.
+DLLLOCAL QoreValue msgpack_unpack_at(const char* data, size_t size, size_t offset, OperationMode mode, ExceptionSink* xsink);
+
+//! Decode only the value at \a path, skipping everything else.
+DLLLOCAL QoreValue msgpack_get(const BinaryNode* data, const QoreString* path, OperationMode mode, ExceptionSink* xsink);
+
+DLLLOCAL QoreValue msgpack_unpack(const BinaryNode* data, UnpackContext& ctx, ExceptionSink* xsink);
+
+DLLLOCAL inline QoreValue msgpack_unpack(const BinaryNode* data, OperationMode mode, ExceptionSink* xsink) {
+    UnpackContext ctx(mode);
+    return msgpack_unpack(data, ctx, xsink);
+}
+
+//! Unpack passed data, keeping only the map entries selected by \a projection.
+DLLLOCAL QoreValue msgpack_unpack_projected(const BinaryNode* data, const QoreHashNode* projection, UnpackContext& ctx, ExceptionSink* xsink);
+
+DLLLOCAL inline QoreValue msgpack_unpack_projected(const BinaryNode* data, const QoreHashNode* projection, OperationMode mode, ExceptionSink* xsink) {
+    UnpackContext ctx(mode);
+    return msgpack_unpack_projected(data, projection, ctx, xsink);
+}
+
+//! Context of a reader filled from an input stream.
+struct StreamReaderContext {
+    InputStream* is;
+    ExceptionSink* xsink;
+};
+
+//! Initialize a reader filling \a buffer from the input stream in \a ctx on demand.
+DLLLOCAL void msgpack_stream_reader_init(mpack_reader_t* reader, char* buffer, size_t size, StreamReaderContext* ctx);
+
+//! Unpack all values from an input stream, reading it through a fixed-size buffer.
+DLLLOCAL QoreValue msgpack_unpack_from_stream(InputStream* is, UnpackContext& ctx, ExceptionSink* xsink);
+
+DLLLOCAL inline QoreValue msgpack_unpack_from_stream(InputStream* is, OperationMode mode, ExceptionSink* xsink) {
+    UnpackContext ctx(mode);
+    return msgpack_unpack_from_stream(is, ctx, xsink);
+}
 
 } // namespace intern
 } // namespace msgpack
@@ -0,0 +1,347 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    msgpack_utf8.cpp
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "msgpack_utf8.h"
+
+// std
+#include <cstdint>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MSGPACK_UTF8_X86 1
+#include <immintrin.h>
+#define MSGPACK_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define MSGPACK_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace msgpack {
+namespace intern {
+
+namespace {
+
+//-----------------
+// Scalar checking
+//-----------------
+
+bool utf8_check_scalar(const char* str, size_t len) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(str);
+    const uint8_t* end = p + len;
+
+    while (p < end) {
+        uint8_t lead = *p;
+
+        // ASCII
+        if (lead <= 0x7f) {
+            ++p;
+            continue;
+        }
+
+        // sequence length, minimum code point (to reject overlong sequences) and lead bits
+        size_t n;
+        uint32_t min;
+        uint32_t cp;
+        if ((lead & 0xe0) == 0xc0) {
+            n = 2;
+            min = 0x80;
+            cp = lead & 0x1f;
+        }
+        else if ((lead & 0xf0) == 0xe0) {
+            n = 3;
+            min = 0x800;
+            cp = lead & 0x0f;
+        }
+        else if ((lead & 0xf8) == 0xf0) {
+            n = 4;
+            min = 0x10000;
+            cp = lead & 0x07;
+        }
+        else {
+            // continuation byte without a lead or a lead of a 5+ byte sequence
+            return false;
+        }
+
+        if (static_cast<size_t>(end - p) < n)
+            return false;
+        for (size_t i = 1; i < n; ++i) {
+            if ((p[i] & 0xc0) != 0x80)
+                return false;
+            cp = (cp << 6) | (p[i] & 0x3f);
+        }
+        // overlong sequences, surrogates and code points over the Unicode limit
+        if (cp < min || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+            return false;
+        p += n;
+    }
+    return true;
+}
+
+bool utf8_copy_scalar(char* dst, const char* src, size_t len) {
+    if (dst)
+        memcpy(dst, src, len);
+    return utf8_check_scalar(src, len);
+}
+
+#ifdef MSGPACK_UTF8_X86
+
+//-----------------
+// SIMD checking
+//-----------------
+
+/*
+    The vectorized kernels implement the lookup algorithm from "Validating UTF-8
+    In Less Than One Instruction Per Byte" (J. Keiser, D. Lemire): each byte is
+    classified by three table lookups indexed by the high and low nibble of the
+    previous byte and the high nibble of the byte itself; the results are and-ed,
+    so that a non-zero byte marks an error. Continuation bytes required by 3 and 4
+    byte sequences are checked separately. Blocks of ASCII characters are only
+    checked for an incomplete sequence at the end of the previous block.
+*/
+
+// error bits of the lookup tables
+constexpr uint8_t TOO_SHORT = 1 << 0;      // lead byte or ASCII followed by a lead byte or ASCII
+constexpr uint8_t TOO_LONG = 1 << 1;       // ASCII followed by a continuation byte
+constexpr uint8_t OVERLONG_3 = 1 << 2;     // 11100000 100_____
+constexpr uint8_t TOO_LARGE = 1 << 3;      // 11110100 1001____, 11110100 101_____, 11110101+ 10______
+constexpr uint8_t SURROGATE = 1 << 4;      // 11101101 101_____
+constexpr uint8_t OVERLONG_2 = 1 << 5;     // 1100000_ 10______
+constexpr uint8_t TOO_LARGE_1000 = 1 << 6; // 11110101+ 1000____
+constexpr uint8_t OVERLONG_4 = 1 << 6;     // 11110000 1000____
+constexpr uint8_t TWO_CONTS = 1 << 7;      // continuation byte followed by a continuation byte
+constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+#define MSGPACK_UTF8_BYTE_1_HIGH \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+    TOO_SHORT | OVERLONG_2, \
+    TOO_SHORT, \
+    TOO_SHORT | OVERLONG_3 | SURROGATE, \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define MSGPACK_UTF8_BYTE_1_LOW \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+    CARRY | OVERLONG_2, \
+    CARRY, \
+    CARRY, \
+    CARRY | TOO_LARGE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define MSGPACK_UTF8_BYTE_2_HIGH \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+alignas(16) const uint8_t byte1HighTable[16] = {MSGPACK_UTF8_BYTE_1_HIGH};
+alignas(16) const uint8_t byte1LowTable[16] = {MSGPACK_UTF8_BYTE_1_LOW};
+alignas(16) const uint8_t byte2HighTable[16] = {MSGPACK_UTF8_BYTE_2_HIGH};
+
+#undef MSGPACK_UTF8_BYTE_1_HIGH
+#undef MSGPACK_UTF8_BYTE_1_LOW
+#undef MSGPACK_UTF8_BYTE_2_HIGH
+
+// maximum values of the last three bytes of a block that do not start an incomplete sequence
+alignas(32) const uint8_t incompleteMax[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1,
+};
+
+// SSSE3 kernel (16 bytes per block)
+
+MSGPACK_TARGET_SSSE3 inline __m128i ssse3_check_block(__m128i input, __m128i prevInput) {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i prev1 = _mm_alignr_epi8(input, prevInput, 15);
+
+    __m128i byte1High = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(byte1HighTable)),
+        _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+    __m128i byte1Low = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(byte1LowTable)),
+        _mm_and_si128(prev1, nibble));
+    __m128i byte2High = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(byte2HighTable)),
+        _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+    // bytes that must be continuations of 3 and 4 byte sequences
+    __m128i prev2 = _mm_alignr_epi8(input, prevInput, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prevInput, 13);
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+
+    return _mm_xor_si128(must23, special);
+}
+
+MSGPACK_TARGET_SSSE3 bool utf8_copy_ssse3(char* dst, const char* src, size_t len) {
+    const __m128i incompleteMask = _mm_load_si128(reinterpret_cast<const __m128i*>(incompleteMax + 16));
+    __m128i error = _mm_setzero_si128();
+    __m128i prevInput = _mm_setzero_si128();
+    __m128i prevIncomplete = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        if (dst)
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), input);
+        if (!_mm_movemask_epi8(input)) {
+            error = _mm_or_si128(error, prevIncomplete);
+            prevIncomplete = _mm_setzero_si128();
+        }
+        else {
+            error = _mm_or_si128(error, ssse3_check_block(input, prevInput));
+            prevIncomplete = _mm_subs_epu8(input, incompleteMask);
+        }
+        prevInput = input;
+    }
+
+    // check the rest padded with ASCII zeros
+    if (i < len) {
+        alignas(16) char buf[16] = {};
+        memcpy(buf, src + i, len - i);
+        if (dst)
+            memcpy(dst + i, src + i, len - i);
+        __m128i input = _mm_load_si128(reinterpret_cast<const __m128i*>(buf));
+        error = _mm_or_si128(error, ssse3_check_block(input, prevInput));
+        prevIncomplete = _mm_setzero_si128();
+    }
+    error = _mm_or_si128(error, prevIncomplete);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+}
+
+// AVX2 kernel (32 bytes per block)
+
+MSGPACK_TARGET_AVX2 inline __m256i avx2_table(const uint8_t* table) {
+    return _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table)));
+}
+
+MSGPACK_TARGET_AVX2 inline __m256i avx2_check_block(__m256i input, __m256i prevInput) {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    // the last 16 bytes of the previous block followed by the first 16 bytes of this block
+    __m256i shifted = _mm256_permute2x128_si256(prevInput, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+
+    __m256i byte1High = _mm256_shuffle_epi8(avx2_table(byte1HighTable), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    __m256i byte1Low = _mm256_shuffle_epi8(avx2_table(byte1LowTable), _mm256_and_si256(prev1, nibble));
+    __m256i byte2High = _mm256_shuffle_epi8(avx2_table(byte2HighTable), _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+    // bytes that must be continuations of 3 and 4 byte sequences
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+
+    return _mm256_xor_si256(must23, special);
+}
+
+MSGPACK_TARGET_AVX2 bool utf8_copy_avx2(char* dst, const char* src, size_t len) {
+    const __m256i incompleteMask = _mm256_load_si256(reinterpret_cast<const __m256i*>(incompleteMax));
+    __m256i error = _mm256_setzero_si256();
+    __m256i prevInput = _mm256_setzero_si256();
+    __m256i prevIncomplete = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        if (dst)
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), input);
+        if (!_mm256_movemask_epi8(input)) {
+            error = _mm256_or_si256(error, prevIncomplete);
+            prevIncomplete = _mm256_setzero_si256();
+        }
+        else {
+            error = _mm256_or_si256(error, avx2_check_block(input, prevInput));
+            prevIncomplete = _mm256_subs_epu8(input, incompleteMask);
+        }
+        prevInput = input;
+    }
+
+    // check the rest padded with ASCII zeros
+    if (i < len) {
+        alignas(32) char buf[32] = {};
+        memcpy(buf, src + i, len - i);
+        if (dst)
+            memcpy(dst + i, src + i, len - i);
+        __m256i input = _mm256_load_si256(reinterpret_cast<const __m256i*>(buf));
+        error = _mm256_or_si256(error, avx2_check_block(input, prevInput));
+        prevIncomplete = _mm256_setzero_si256();
+    }
+    error = _mm256_or_si256(error, prevIncomplete);
+
+    return _mm256_testz_si256(error, error);
+}
+
+#endif // MSGPACK_UTF8_X86
+
+typedef bool (*Utf8CopyFunc)(char* dst, const char* src, size_t len);
+
+// Selects the fastest kernel supported by the CPU.
+Utf8CopyFunc utf8_select_kernel() {
+#ifdef MSGPACK_UTF8_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return utf8_copy_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return utf8_copy_ssse3;
+#endif
+    return utf8_copy_scalar;
+}
+
+// Strings shorter than this are always checked by the scalar loop.
+constexpr size_t UTF8_SIMD_MIN_SIZE = 16;
+
+inline bool utf8_copy(char* dst, const char* src, size_t len) {
+    static const Utf8CopyFunc kernel = utf8_select_kernel();
+    if (len < UTF8_SIMD_MIN_SIZE)
+        return utf8_copy_scalar(dst, src, len);
+    return kernel(dst, src, len);
+}
+
+} // namespace
+
+bool msgpack_utf8_check(const char* str, size_t len) {
+    return utf8_copy(nullptr, str, len);
+}
+
+bool msgpack_utf8_copy(char* dst, const char* src, size_t len) {
+    return utf8_copy(dst, src, len);
+}
+
+} // namespace intern
+} // namespace msgpack
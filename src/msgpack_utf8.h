@@ -0,0 +1,55 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    msgpack_utf8.h
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _QORE_MODULE_MSGPACK_MSGPACK_UTF8_H
+#define _QORE_MODULE_MSGPACK_MSGPACK_UTF8_H
+
+// std
+#include <cstddef>
+
+// qore
+#include "qore/Qore.h"
+
+namespace msgpack {
+namespace intern {
+
+//! Check that a string is valid UTF-8 (the same rules as used by mpack when unpacking strings).
+/**
+    Uses SSSE3 or AVX2 kernels when supported by the CPU and a scalar loop otherwise.
+*/
+DLLLOCAL bool msgpack_utf8_check(const char* str, size_t len);
+
+//! Copy a string to \a dst and check that it is valid UTF-8 in a single pass.
+/**
+    \a dst must have room for \a len bytes; its contents are undefined if the string is not valid.
+*/
+DLLLOCAL bool msgpack_utf8_copy(char* dst, const char* src, size_t len);
+
+} // namespace intern
+} // namespace msgpack
+
+#endif // _QORE_MODULE_MSGPACK_MSGPACK_UTF8_H
@@ -0,0 +1,297 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    msgpack_validate.cpp
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#include "msgpack_validate.h"
+
+// std
+#include <cstdint>
+#include <vector>
+
+// module sources
+#include "msgpack_extensions.h"
+#include "MsgPackException.h"
+
+namespace msgpack {
+namespace intern {
+
+namespace {
+
+//! Open list or hash.
+struct ValidateLevel {
+    //! Number of child values still to come (keys and values both count).
+    uint64_t remaining;
+    bool map;
+};
+
+// Qore date extension sizes (see msgpack_extensions.h)
+constexpr uint32_t QORE_DATE_ABSOLUTE_SIZE = 1 + 8 + 4 + 4;
+constexpr uint32_t QORE_DATE_RELATIVE_SIZE = 1 + 7 * 4;
+
+// Checks the payload of a timestamp extension; the size is the payload size without the ext tag.
+void validate_timestamp(const char* p, uint32_t size) {
+    uint32_t ns;
+    switch (size) {
+        case 4:
+            return;
+        case 8:
+            ns = mpack_load_u32(p) >> 2;
+            break;
+        case 12:
+            ns = mpack_load_u32(p);
+            break;
+        default:
+            throw getMsgPackException(mpack_error_invalid);
+    }
+    if (ns > MPACK_TIMESTAMP_NANOSECONDS_MAX)
+        throw getMsgPackException(mpack_error_invalid);
+}
+
+void validate_qore_ext(int8_t type, const char* p, uint32_t size) {
+    switch (type) {
+        case MSGPACK_EXT_QORE_NULL:
+            if (size == 0)
+                return;
+            break;
+        case MSGPACK_EXT_QORE_DATE:
+            if ((size == QORE_DATE_ABSOLUTE_SIZE && p[0] == 1) || (size == QORE_DATE_RELATIVE_SIZE && p[0] != 1))
+                return;
+            break;
+        case MSGPACK_EXT_QORE_NUMBER:
+            if (size == 1 && p[0] >= MSGPACK_NUMBER_NAN && p[0] <= MSGPACK_NUMBER_NINF)
+                return;
+            // 1B number type + 4B precision + number string
+            if (size >= 6 && p[0] == MSGPACK_NUMBER_NORM)
+                return;
+            // 1B number type + 1B scale + 1, 2, 4 or 8B coefficient
+            if ((size == 3 || size == 4 || size == 6 || size == 10) && p[0] == MSGPACK_NUMBER_DECIMAL
+                && static_cast<unsigned char>(p[1]) <= MSGPACK_NUMBER_MAX_SCALE)
+                return;
+            break;
+        case MSGPACK_EXT_QORE_STRING:
+            if (size >= 1 && p[0] >= QE_USASCII && p[0] <= QE_KOI7)
+                return;
+            break;
+        case MSGPACK_EXT_QORE_TYPED_ARRAY: {
+            size_t elementSize = size >= 1 ? msgpack_typed_array_element_size(p[0]) : 0;
+            if (elementSize && (size - 1) % elementSize == 0)
+                return;
+            break;
+        }
+        default:
+            break;
+    }
+    throw getMsgPackException(mpack_error_data);
+}
+
+InspectType inspect_type(uint8_t type) {
+    if (type <= 0x7f || type >= 0xe0 || (type >= 0xcc && type <= 0xd3))
+        return INSPECT_INT;
+    if (msgpack_is_map_type(type))
+        return INSPECT_MAP;
+    if (msgpack_is_array_type(type))
+        return INSPECT_ARRAY;
+    if (msgpack_is_str_type(type))
+        return INSPECT_STR;
+    switch (type) {
+        case 0xc0: return INSPECT_NIL;
+        case 0xc2: case 0xc3: return INSPECT_BOOL;
+        case 0xca: case 0xcb: return INSPECT_FLOAT;
+        case 0xc4: case 0xc5: case 0xc6: return INSPECT_BIN;
+        default: return INSPECT_EXT;
+    }
+}
+
+void inspect_value(InspectStats& stats, uint8_t type, const char* p, const ScanHeader& hdr) {
+    InspectType t = inspect_type(type);
+    uint32_t len = static_cast<uint32_t>(hdr.payload);
+    ++stats.count[t];
+    stats.bytes[t] += hdr.size + hdr.payload;
+    switch (t) {
+        case INSPECT_STR:
+            if (len > stats.maxStr)
+                stats.maxStr = len;
+            break;
+        case INSPECT_BIN:
+            if (len > stats.maxBin)
+                stats.maxBin = len;
+            break;
+        case INSPECT_EXT:
+            if (len > stats.maxExt)
+                stats.maxExt = len;
+            ++stats.extTypes[static_cast<int8_t>(p[hdr.size - 1]) + 128];
+            break;
+        case INSPECT_ARRAY:
+            ++stats.arraySizes[InspectStats::bucket(static_cast<uint32_t>(hdr.children))];
+            break;
+        case INSPECT_MAP:
+            ++stats.mapSizes[InspectStats::bucket(static_cast<uint32_t>(hdr.children / 2))];
+            break;
+        default:
+            break;
+    }
+}
+
+} // namespace
+
+void msgpack_validate(const char* data, size_t size, OperationMode mode, const UnpackLimits& limits, ValidateResult& result, InspectStats* stats) {
+    std::vector<ValidateLevel> stack;
+    size_t offset = 0;
+    size_t allocated = 0;
+
+    while (offset < size) {
+        ++result.values;
+        do {
+            if (offset >= size)
+                throw getMsgPackException(mpack_error_invalid);
+
+            const char* p = data + offset;
+            uint8_t type = static_cast<uint8_t>(*p);
+            ScanHeader hdr;
+            if (!msgpack_scan_header(p, size - offset, hdr) || hdr.payload > size - offset - hdr.size)
+                throw getMsgPackException(mpack_error_invalid);
+            const char* payload = p + hdr.size;
+            uint32_t len = static_cast<uint32_t>(hdr.payload);
+
+            // hash keys must be strings
+            bool key = !stack.empty() && stack.back().map && !(stack.back().remaining % 2);
+            bool ext = (type >= 0xc7 && type <= 0xc9) || (type >= 0xd4 && type <= 0xd8);
+            if (key && !msgpack_is_str_type(type)
+                && !(mode == MSGPACK_QORE_MODE && ext && static_cast<int8_t>(p[hdr.size - 1]) == MSGPACK_EXT_QORE_STRING))
+                throw getMsgPackException(mpack_error_data);
+
+            if (msgpack_is_str_type(type) || (type >= 0xc4 && type <= 0xc6) || ext) {
+                if (len > limits.maxAllocSize - allocated)
+                    throw MsgPackExceptionMaker("total size of strings, binaries and extensions exceeds the limit of %zu bytes", limits.maxAllocSize);
+                allocated += len;
+            }
+
+            if (msgpack_is_str_type(type)) {
+                if (len > limits.maxStrSize)
+                    throw MsgPackExceptionMaker("string size %u exceeds the limit of %zu bytes", len, limits.maxStrSize);
+                if (!msgpack_utf8_check(payload, len))
+                    throw getMsgPackException(mpack_error_type);
+            }
+            else if (type >= 0xc4 && type <= 0xc6) {
+                if (len > limits.maxBinSize)
+                    throw MsgPackExceptionMaker("binary size %u exceeds the limit of %zu bytes", len, limits.maxBinSize);
+            }
+            else if (ext) {
+                if (len > limits.maxExtSize)
+                    throw MsgPackExceptionMaker("extension size %u exceeds the limit of %zu bytes", len, limits.maxExtSize);
+                int8_t exttype = static_cast<int8_t>(p[hdr.size - 1]);
+                if (exttype == MPACK_EXTTYPE_TIMESTAMP)
+                    validate_timestamp(payload, len);
+                else if (mode == MSGPACK_QORE_MODE)
+                    validate_qore_ext(exttype, payload, len);
+            }
+            if (stats)
+                inspect_value(*stats, type, p, hdr);
+            offset += hdr.size + len;
+
+            // open a new list or hash
+            bool map = msgpack_is_map_type(type);
+            if (map || msgpack_is_array_type(type)) {
+                uint64_t count = map ? hdr.children / 2 : hdr.children;
+                if (count > limits.maxElements - result.elements)
+                    throw MsgPackExceptionMaker("number of elements exceeds the limit of %zu", limits.maxElements);
+                result.elements += count;
+                if (stack.size() + 1 > result.depth) {
+                    if (stack.size() + 1 > limits.maxDepth)
+                        throw MsgPackExceptionMaker("nesting depth exceeds the limit of %zu", limits.maxDepth);
+                    result.depth = stack.size() + 1;
+                }
+                if (hdr.children) {
+                    stack.push_back({hdr.children, map});
+                    continue;
+                }
+            }
+
+            // the value is complete; close all lists and hashes completed by it
+            while (!stack.empty() && !--stack.back().remaining)
+                stack.pop_back();
+        }
+        while (!stack.empty());
+    }
+}
+
+static QoreHashNode* msgpack_inspect_histogram(const uint64_t* buckets, ExceptionSink* xsink) {
+    ReferenceHolder<QoreHashNode> h(new QoreHashNode(bigIntTypeInfo), xsink);
+    for (size_t i = 0; i < INSPECT_HISTOGRAM_BUCKETS; ++i) {
+        if (!buckets[i])
+            continue;
+        QoreString key;
+        key.sprintf(QLLD, i ? (1ll << (i - 1)) : 0ll);
+        h->setKeyValue(key.c_str(), static_cast<int64>(buckets[i]), xsink);
+    }
+    return h.release();
+}
+
+QoreHashNode* msgpack_inspect(const BinaryNode* data, OperationMode mode, ExceptionSink* xsink) {
+    static const char* typeNames[INSPECT_TYPE_COUNT] = {
+        "nil", "bool", "int", "float", "str", "bin", "array", "map", "ext",
+    };
+
+    ValidateResult result;
+    InspectStats stats;
+    msgpack_validate(static_cast<const char*>(data->getPtr()), data->size(), mode, UnpackLimits(), result, &stats);
+
+    ReferenceHolder<QoreHashNode> h(new QoreHashNode(autoTypeInfo), xsink);
+    h->setKeyValue("size", static_cast<int64>(data->size()), xsink);
+    h->setKeyValue("values", static_cast<int64>(result.values), xsink);
+    h->setKeyValue("depth", static_cast<int64>(result.depth), xsink);
+    h->setKeyValue("elements", static_cast<int64>(result.elements), xsink);
+
+    ReferenceHolder<QoreHashNode> types(new QoreHashNode(autoTypeInfo), xsink);
+    for (size_t i = 0; i < INSPECT_TYPE_COUNT; ++i) {
+        ReferenceHolder<QoreHashNode> t(new QoreHashNode(bigIntTypeInfo), xsink);
+        t->setKeyValue("count", static_cast<int64>(stats.count[i]), xsink);
+        t->setKeyValue("bytes", static_cast<int64>(stats.bytes[i]), xsink);
+        types->setKeyValue(typeNames[i], t.release(), xsink);
+    }
+    h->setKeyValue("types", types.release(), xsink);
+
+    h->setKeyValue("max_str_size", static_cast<int64>(stats.maxStr), xsink);
+    h->setKeyValue("max_bin_size", static_cast<int64>(stats.maxBin), xsink);
+    h->setKeyValue("max_ext_size", static_cast<int64>(stats.maxExt), xsink);
+    h->setKeyValue("array_sizes", msgpack_inspect_histogram(stats.arraySizes, xsink), xsink);
+    h->setKeyValue("map_sizes", msgpack_inspect_histogram(stats.mapSizes, xsink), xsink);
+
+    ReferenceHolder<QoreHashNode> exts(new QoreHashNode(bigIntTypeInfo), xsink);
+    for (int i = 0; i < 256; ++i) {
+        if (!stats.extTypes[i])
+            continue;
+        QoreString key;
+        key.sprintf("%d", i - 128);
+        exts->setKeyValue(key.c_str(), static_cast<int64>(stats.extTypes[i]), xsink);
+    }
+    h->setKeyValue("ext_types", exts.release(), xsink);
+
+    return h.release();
+}
+
+} // namespace intern
+} // namespace msgpack
@@ -0,0 +1,115 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+/*
+    msgpack_validate.h
+
+    Qore MessagePack module
+
+    Copyright (C) 2018 Qore Technologies, s.r.o.
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _QORE_MODULE_MSGPACK_MSGPACK_VALIDATE_H
+#define _QORE_MODULE_MSGPACK_MSGPACK_VALIDATE_H
+
+// std
+#include <cstdint>
+
+// qore
+#include "qore/Qore.h"
+
+// module sources
+#include "msgpack_enums.h"
+#include "msgpack_unpack.h"
+
+namespace msgpack {
+namespace intern {
+
+//! Structure of validated data.
+struct ValidateResult {
+    //! Number of top-level values.
+    size_t values = 0;
+    //! Maximum nesting depth of lists and hashes.
+    size_t depth = 0;
+    //! Total number of list elements and hash entries.
+    size_t elements = 0;
+};
+
+//! Value types distinguished by the statistics.
+enum InspectType {
+    INSPECT_NIL,
+    INSPECT_BOOL,
+    INSPECT_INT,
+    INSPECT_FLOAT,
+    INSPECT_STR,
+    INSPECT_BIN,
+    INSPECT_ARRAY,
+    INSPECT_MAP,
+    INSPECT_EXT,
+    INSPECT_TYPE_COUNT,
+};
+
+//! Number of power-of-two buckets of the container size histograms (sizes are at most 2^32 - 1).
+constexpr size_t INSPECT_HISTOGRAM_BUCKETS = 33;
+
+//! Statistics of validated data.
+struct InspectStats {
+    //! Number of values per type.
+    uint64_t count[INSPECT_TYPE_COUNT] = {};
+    //! Encoded bytes per type (only headers for lists and hashes).
+    uint64_t bytes[INSPECT_TYPE_COUNT] = {};
+    //! Sizes of the largest string, binary and extension data.
+    uint32_t maxStr = 0;
+    uint32_t maxBin = 0;
+    uint32_t maxExt = 0;
+    //! Histograms of list and hash sizes; bucket 0 counts empty containers, bucket n sizes in [2^(n-1), 2^n).
+    uint64_t arraySizes[INSPECT_HISTOGRAM_BUCKETS] = {};
+    uint64_t mapSizes[INSPECT_HISTOGRAM_BUCKETS] = {};
+    //! Number of extensions per extension type (indexed by type + 128).
+    uint64_t extTypes[256] = {};
+
+    //! Get the histogram bucket for a container size.
+    DLLLOCAL static size_t bucket(uint32_t size) {
+        size_t b = 0;
+        while (size) {
+            ++b;
+            size >>= 1;
+        }
+        return b;
+    }
+};
+
+//! Check that the data is well-formed and within limits without creating any Qore values.
+/**
+    In Qore mode the data also has to be unpackable in Qore mode, i.e. all extensions
+    have to be known with valid data and all hash keys have to be strings.
+
+    If \a stats is passed, statistics of the data are collected in the same pass.
+
+    @throw MsgPackException if the data is invalid or exceeds a limit
+*/
+DLLLOCAL void msgpack_validate(const char* data, size_t size, OperationMode mode, const UnpackLimits& limits, ValidateResult& result, InspectStats* stats = nullptr);
+
+//! Collect statistics of packed data without unpacking it.
+DLLLOCAL QoreHashNode* msgpack_inspect(const BinaryNode* data, OperationMode mode, ExceptionSink* xsink);
+
+} // namespace intern
+} // namespace msgpack
+
+#endif // _QORE_MODULE_MSGPACK_MSGPACK_VALIDATE_H